@@ -0,0 +1,690 @@
+#include "HuffmanCodec.h"
+#include "ThreadPool.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+#include <iterator>
+#include <map>
+#include <atomic>
+#include <numeric>
+#include <cstdlib>
+using namespace std;
+using namespace chrono;
+
+// A named input buffer, generated from a fixed seed or read from a file
+struct Corpus {
+    string name;
+    vector<uint8_t> data;
+};
+
+// One measured configuration: stage times in ms over the timed iterations
+struct Result {
+    string corpus, stage;
+    int threads;
+    uint32_t blockKiB;
+    size_t bytes;
+    vector<double> samples;
+    double ratio; // compressed / original, 0 where not applicable
+};
+
+struct BenchConfig {
+    size_t corpusSize = 16 << 20;
+    vector<int> threadCounts = {1};
+    vector<uint32_t> blockKiBs = {DEFAULT_BLOCK_SIZE / 1024};
+    int warmup = 1;
+    int iterations = 5;
+    bool json = false;
+    string outputName;
+    vector<string> corpusFiles;
+    bool generated = true;
+    HuffmanEngine engine = HuffmanEngine::Order0;
+    bool pinned = false;
+    HuffmanKernels kernels = HuffmanKernels::Best;
+    bool check = false;
+    int corruptions = 100;
+    string baselineName;
+    double tolerance = 10;
+};
+
+void printUsage() {
+    cerr << "Usage: huffman-bench [options] [corpus-file ...]\n"
+            "  -s MiB       size of each generated corpus (default 16)\n"
+            "  -t N,N,...   thread counts (default 1)\n"
+            "  -b KiB,...   block sizes in KiB (default 1024)\n"
+            "  -w N         warmup iterations (default 1)\n"
+            "  -i N         timed iterations (default 5)\n"
+            "  -f csv|json  output format (default csv)\n"
+            "  -e NAME      encoder engine, order0 (default) or lz77\n"
+            "  -o FILE      write results to FILE instead of stdout\n"
+            "  -n           skip the generated corpora, only bench the given files\n"
+            "  -p           pin pool workers to CPUs, spread over the NUMA nodes\n"
+            "  -k NAME      kernels, best (default) or portable\n"
+            "  -c           check instead of timing: every configuration, both engines and both\n"
+            "               kernel sets must round-trip and write identical containers\n"
+            "  -z N         corrupted archives decoded per configuration with -c (default 100)\n"
+            "  -B FILE      fail if any stage is slower than in FILE, an earlier -f json run\n"
+            "  -T PCT       slowdown -B tolerates, in percent (default 10)\n"
+            "Generated corpora (text, binary, skewed, mixed, zeros) use fixed seeds and are\n"
+            "identical across runs and hosts.\n";
+}
+
+bool parseList(const string& text, vector<long>& values) {
+    values.clear();
+    stringstream items(text);
+    for (string item; getline(items, item, ',');) {
+        char* end;
+        long value = strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end || value <= 0) return false;
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+// Word-like text: Zipf-distributed words over a fixed vocabulary, with punctuation and lines
+vector<uint8_t> generateText(size_t size, mt19937_64& rng) {
+    vector<string> vocabulary;
+    uniform_int_distribution<int> wordLength(2, 10), letter('a', 'z');
+    for (int i = 0; i < 2000; ++i) {
+        string word;
+        for (int n = wordLength(rng); n > 0; --n) word += char(letter(rng));
+        vocabulary.push_back(word);
+    }
+    vector<double> weights;
+    for (size_t i = 0; i < vocabulary.size(); ++i) weights.push_back(1.0 / double(i + 1));
+    discrete_distribution<size_t> pick(weights.begin(), weights.end());
+    uniform_int_distribution<int> punctuation(0, 15);
+
+    vector<uint8_t> data;
+    data.reserve(size + 16);
+    int column = 0;
+    while (data.size() < size) {
+        const string& word = vocabulary[pick(rng)];
+        data.insert(data.end(), word.begin(), word.end());
+        column += int(word.size()) + 1;
+        int mark = punctuation(rng);
+        if (mark == 0) data.push_back('.');
+        if (mark == 1) data.push_back(',');
+        if (column > 72) {
+            data.push_back('\n');
+            column = 0;
+        } else {
+            data.push_back(' ');
+        }
+    }
+    data.resize(size);
+    return data;
+}
+
+// The fixed generated set; each corpus has its own seed so adding one changes no other
+vector<Corpus> generateCorpora(size_t size) {
+    vector<Corpus> corpora;
+    mt19937_64 textRng(1);
+    corpora.push_back({"text", generateText(size, textRng)});
+
+    mt19937_64 binaryRng(2);
+    vector<uint8_t> binary(size);
+    for (uint8_t& byte : binary) byte = uint8_t(binaryRng());
+    corpora.push_back({"binary", binary});
+
+    // Geometric byte distribution: a few very common values and a long tail of long codes
+    mt19937_64 skewedRng(3);
+    geometric_distribution<int> geometric(0.08);
+    vector<uint8_t> skewed(size);
+    for (uint8_t& byte : skewed) byte = uint8_t(min(geometric(skewedRng), 255));
+    corpora.push_back({"skewed", skewed});
+
+    // Alternating 256 KiB sections of text, random bytes and zero runs
+    mt19937_64 mixedRng(4);
+    vector<uint8_t> mixedText = generateText(size, mixedRng);
+    vector<uint8_t> mixed(size);
+    const size_t SECTION = 256 << 10;
+    for (size_t offset = 0; offset < size; ++offset) {
+        size_t section = (offset / SECTION) % 3;
+        mixed[offset] = section == 0 ? mixedText[offset] : section == 1 ? uint8_t(mixedRng()) : 0;
+    }
+    corpora.push_back({"mixed", mixed});
+
+    corpora.push_back({"zeros", vector<uint8_t>(size, 0)});
+    return corpora;
+}
+
+bool loadCorpus(const string& path, Corpus& corpus) {
+    ifstream input(path, ios::binary);
+    if (!input) return false;
+    corpus.name = filesystem::path(path).filename().string();
+    corpus.data.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+    return true;
+}
+
+// Run `body` warmup + iterations times, keeping the timed samples in ms; false if any run fails
+bool measure(const BenchConfig& config, vector<double>& samples, const function<bool()>& body) {
+    samples.clear();
+    for (int i = 0; i < config.warmup + config.iterations; ++i) {
+        auto start = high_resolution_clock::now();
+        if (!body()) return false;
+        auto end = high_resolution_clock::now();
+        if (i >= config.warmup) samples.push_back(duration_cast<nanoseconds>(end - start).count() / 1e6);
+    }
+    return true;
+}
+
+// Nearest-rank percentile of the samples
+double percentile(vector<double> samples, double fraction) {
+    sort(samples.begin(), samples.end());
+    size_t rank = size_t(fraction * double(samples.size()) + 0.999999);
+    return samples[min(samples.size(), max<size_t>(rank, 1)) - 1];
+}
+
+bool writeFile(const string& path, const vector<uint8_t>& data) {
+    ofstream output(path, ios::binary);
+    output.write((const char*)data.data(), data.size());
+    return bool(output.flush());
+}
+
+bool readFile(const string& path, vector<uint8_t>& data) {
+    ifstream input(path, ios::binary);
+    data.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+    return !input.bad();
+}
+
+// Every stage of one corpus at one thread count and block size
+bool benchCorpus(const BenchConfig& config, const Corpus& corpus, int threads, uint32_t blockKiB, ThreadPool* pool,
+                 const string& scratchDir, vector<Result>& results) {
+    span<const uint8_t> input(corpus.data.data(), corpus.data.size());
+    HuffmanOptions options;
+    options.threadCount = threads;
+    options.pool = pool;
+    options.blockSize = blockKiB * 1024;
+    options.engine = config.engine;
+    auto record = [&](const string& stage, int stageThreads, uint32_t stageBlock, const vector<double>& samples,
+                      double ratio) {
+        results.push_back(Result{corpus.name, stage, stageThreads, stageBlock, corpus.data.size(), samples, ratio});
+    };
+    vector<double> samples;
+
+    // Histogram and tree build do not depend on the block size; bench them once per thread count
+    if (blockKiB == config.blockKiBs.front()) {
+        array<uint64_t, 256> counts;
+        if (!measure(config, samples, [&] {
+                countByteFrequencies(input, pool, counts);
+                return true;
+            }))
+            return false;
+        record("histogram", threads, 0, samples, 0);
+
+        if (threads == config.threadCounts.front()) {
+            array<uint8_t, 256> lengths;
+            if (!measure(config, samples, [&] {
+                    computeCodeLengths(counts, options.maxCodeLength, lengths);
+                    return true;
+                }))
+                return false;
+            record("tree", 1, 0, samples, 0);
+        }
+    }
+
+    HuffmanEncoder encoder(options);
+    vector<uint8_t> packed(encoder.maxCompressedSize(input.size()));
+    size_t packedSize = 0;
+    if (!measure(config, samples, [&] { return encoder.compress(input, packed, packedSize); })) return false;
+    double ratio = input.empty() ? 0 : double(packedSize) / double(input.size());
+    record("encode", threads, blockKiB, samples, ratio);
+
+    HuffmanDecoder decoder(options);
+    vector<uint8_t> restored(input.size());
+    size_t restoredSize = 0;
+    if (!measure(config, samples, [&] {
+            return decoder.decompress({packed.data(), packedSize}, restored, restoredSize);
+        }))
+        return false;
+    if (restoredSize != input.size() || !equal(restored.begin(), restored.end(), corpus.data.begin())) {
+        cerr << "Error: " << corpus.name << " did not round-trip.\n";
+        return false;
+    }
+    record("decode", threads, blockKiB, samples, ratio);
+
+    // File to file through the page cache: the difference to encode/decode is the I/O cost
+    string original = scratchDir + "/bench.raw", compressed = scratchDir + "/bench.huf",
+           roundTrip = scratchDir + "/bench.out";
+    if (!writeFile(original, corpus.data)) return false;
+    if (!measure(config, samples, [&] { return compressDataFile(original, compressed, options); })) return false;
+    record("file_compress", threads, blockKiB, samples, ratio);
+    if (!measure(config, samples, [&] { return decompressDataFile(compressed, roundTrip, options); })) return false;
+    vector<uint8_t> restoredFile;
+    if (!readFile(roundTrip, restoredFile) || restoredFile != corpus.data) {
+        cerr << "Error: " << corpus.name << " did not round-trip through files.\n";
+        return false;
+    }
+    record("file_decompress", threads, blockKiB, samples, ratio);
+    return true;
+}
+
+// Code length caps a check covers: each selects a different kernel where the data has
+// codes that long
+const int CHECK_CODE_LENGTHS[] = {12, 14, 18, 28, 32};
+
+// Correctness of one configuration, with the kernels already selected. The corpus must
+// come back from memory, byte ranges, files, streamed files and verify, and the container
+// must equal `reference`, written with the same engine, cap and block size on one thread
+// with the portable kernels, so no thread count or kernel set changes the format.
+// Corrupted copies must fail to decode or decode to the corpus, whether through memory,
+// a range, a streamed file or verify. `original` holds the corpus.
+void checkConfiguration(const BenchConfig& config, const Corpus& corpus, const HuffmanOptions& options,
+                        const string& original, const string& scratchDir, const vector<uint8_t>& reference,
+                        vector<string>& failures) {
+    span<const uint8_t> input(corpus.data.data(), corpus.data.size());
+    string compressed = scratchDir + "/check.huf", roundTrip = scratchDir + "/check.out";
+    string name = corpus.name + ", " + to_string(options.threadCount) + " threads, " +
+                  to_string(options.blockSize / 1024) + " KiB, -l " + to_string(options.maxCodeLength) + ", " +
+                  (options.engine == HuffmanEngine::Lz77 ? "lz77" : "order0") + ", " + kernelName() + ": ";
+    auto fail = [&](const string& what) { failures.push_back(name + what); };
+
+    HuffmanEncoder encoder(options);
+    vector<uint8_t> packed(encoder.maxCompressedSize(input.size()));
+    size_t packedSize = 0;
+    if (!encoder.compress(input, packed, packedSize)) {
+        fail("encode failed");
+        return;
+    }
+    packed.resize(packedSize);
+    if (packed != reference) fail("container differs from the one-thread portable one");
+
+    HuffmanDecoder decoder(options);
+    vector<uint8_t> restored(input.size());
+    size_t restoredSize = 0;
+    if (!decoder.decompress(packed, restored, restoredSize) || restoredSize != input.size() ||
+        restored != corpus.data)
+        fail("in-memory round trip");
+
+    // Ranges from a fixed seed: inside a block, across block edges and past the end
+    mt19937_64 rng(input.size() + options.blockSize);
+    for (int k = 0; k < 8 && !input.empty(); ++k) {
+        uint64_t offset = rng() % input.size();
+        vector<uint8_t> window(rng() % (3 * options.blockSize) + 1);
+        size_t windowSize = 0;
+        size_t expected = min<size_t>(window.size(), input.size() - offset);
+        if (!decoder.decompressRange(packed, offset, window, windowSize) || windowSize != expected ||
+            !equal(window.begin(), window.begin() + ptrdiff_t(expected), input.begin() + ptrdiff_t(offset)))
+            fail("range " + to_string(offset) + "+" + to_string(window.size()));
+    }
+
+    vector<uint8_t> fileBytes, streamed;
+    for (bool streaming : {false, true}) {
+        string mode = streaming ? "streamed file " : "file ";
+        if (!compressDataFile(original, compressed, options, streaming)) {
+            fail(mode + "compress failed");
+            continue;
+        }
+        if (!readFile(compressed, fileBytes) || (!streaming && fileBytes != packed))
+            fail(mode + "container differs from the in-memory one");
+        if (streaming) streamed = fileBytes;
+        if (!verifyDataFile(compressed, options)) fail(mode + "verify failed");
+        if (!decompressDataFile(compressed, roundTrip, options) || !readFile(roundTrip, fileBytes) ||
+            fileBytes != corpus.data)
+            fail(mode + "round trip");
+    }
+
+    // With checksums a damaged block cannot decode to anything but the original. Every
+    // tenth trial damages the streamed container instead and goes through the file
+    // functions, whose error messages are muted; verify must not pass what decompress fails.
+    int damaged = 0, misverified = 0;
+    for (int k = 0; k < config.corruptions && !packed.empty(); ++k) {
+        bool onFile = k % 10 == 9 && !streamed.empty();
+        vector<uint8_t> corrupt = onFile ? streamed : packed;
+        for (int flips = int(rng() % 4) + 1; flips > 0; --flips)
+            corrupt[rng() % corrupt.size()] ^= uint8_t(1u << (rng() % 8));
+        if (onFile) {
+            if (!writeFile(compressed, corrupt)) continue;
+            streambuf* errors = cerr.rdbuf(nullptr);
+            bool verified = verifyDataFile(compressed, options);
+            bool decoded = decompressDataFile(compressed, roundTrip, options) && readFile(roundTrip, fileBytes);
+            cerr.rdbuf(errors);
+            cerr.clear();
+            if (decoded && fileBytes != corpus.data) ++damaged;
+            if (verified && !decoded) ++misverified;
+            continue;
+        }
+        if (decoder.decompress(corrupt, restored, restoredSize) &&
+            (restoredSize != input.size() || restored != corpus.data))
+            ++damaged;
+        uint64_t offset = input.empty() ? 0 : rng() % input.size();
+        vector<uint8_t> window(rng() % (2 * options.blockSize) + 1);
+        size_t windowSize = 0;
+        if (decoder.decompressRange(corrupt, offset, window, windowSize) &&
+            (windowSize > input.size() - offset ||
+             !equal(window.begin(), window.begin() + ptrdiff_t(windowSize), input.begin() + ptrdiff_t(offset))))
+            ++damaged;
+    }
+    if (damaged) fail(to_string(damaged) + " corrupted archives decoded to wrong data");
+    if (misverified) fail(to_string(misverified) + " corrupted archives passed verify but failed to decompress");
+}
+
+// Thread count checked on larger pools as a cap on the workers a call uses
+const int CHECK_WORKER_LIMIT = 2;
+
+// Every engine, code length cap and kernel set for one corpus, thread count and block size
+void checkCorpus(const BenchConfig& config, const Corpus& corpus, int threads, uint32_t blockKiB, ThreadPool* pool,
+                 const string& scratchDir, map<string, vector<uint8_t>>& references, vector<string>& failures) {
+    string original = scratchDir + "/check.raw";
+    if (!writeFile(original, corpus.data)) {
+        failures.push_back(corpus.name + ": cannot write " + original);
+        return;
+    }
+    span<const uint8_t> input(corpus.data.data(), corpus.data.size());
+    for (HuffmanEngine engine : {HuffmanEngine::Order0, HuffmanEngine::Lz77}) {
+        for (int maxCodeLength : CHECK_CODE_LENGTHS) {
+            HuffmanOptions options;
+            options.blockSize = blockKiB * 1024;
+            options.maxCodeLength = maxCodeLength;
+            options.engine = engine;
+            // The reference is always written on one thread with the portable kernels,
+            // whatever thread counts the run lists, and kept for the later ones
+            string key = corpus.name + "/" + to_string(blockKiB) + "/" + to_string(maxCodeLength) + "/" +
+                         to_string(int(engine));
+            if (!references.count(key)) {
+                selectKernels(HuffmanKernels::Portable);
+                HuffmanEncoder encoder(options);
+                vector<uint8_t>& reference = references[key];
+                reference.resize(encoder.maxCompressedSize(input.size()));
+                size_t referenceSize = 0;
+                if (!encoder.compress(input, reference, referenceSize)) {
+                    failures.push_back(corpus.name + ": reference encode failed");
+                    references.erase(key);
+                    continue;
+                }
+                reference.resize(referenceSize);
+            }
+            options.threadCount = threads;
+            options.pool = pool;
+            for (HuffmanKernels kernels : {HuffmanKernels::Portable, HuffmanKernels::Best}) {
+                selectKernels(kernels);
+                checkConfiguration(config, corpus, options, original, scratchDir, references[key], failures);
+            }
+            // A tuned count below the pool's size caps every call at that many workers
+            if (pool && pool->size() > CHECK_WORKER_LIMIT) {
+                options.threadCount = CHECK_WORKER_LIMIT;
+                checkConfiguration(config, corpus, options, original, scratchDir, references[key], failures);
+                HuffmanStats stats;
+                options.stats = &stats;
+                HuffmanEncoder encoder(options);
+                vector<uint8_t> packed(encoder.maxCompressedSize(input.size()));
+                size_t packedSize = 0;
+                encoder.compress(input, packed, packedSize);
+                // Workers may take turns, but no more than the limit run at once
+                uint64_t busy = accumulate(stats.workerBusyNanos.begin(), stats.workerBusyNanos.end(), uint64_t(0));
+                if (busy > CHECK_WORKER_LIMIT * stats.wallNanos)
+                    failures.push_back(corpus.name + ": workers busy " + to_string(double(busy) / stats.wallNanos) +
+                                       " times the wall time under a limit of " + to_string(CHECK_WORKER_LIMIT));
+            }
+        }
+    }
+    selectKernels(config.kernels);
+}
+
+// Stats output for a source name with control characters: JSON escapes every one of
+// them, Prometheus only its newline
+void checkStatsFormat(vector<string>& failures) {
+    HuffmanStats stats;
+    stats.source = "logs\tday\r1\x01\n.txt";
+    string json = formatStatsJson(stats);
+    if (json.rfind("{\"source\":\"logs\\tday\\r1\\u0001\\n.txt\",", 0) != 0)
+        failures.push_back("stats JSON escapes the source name as " + json.substr(0, json.find(',')));
+    string prometheus = formatStatsPrometheus(span<const HuffmanStats>(&stats, 1));
+    if (prometheus.find("{source=\"logs\tday\r1\x01\\n.txt\"}") == string::npos)
+        failures.push_back("stats Prometheus label misquotes the source name");
+}
+
+// Batch mode as the CLI runs it: many small multi-block files, each a root task of one
+// pool that also runs their blocks. Every file must round-trip, and none may start on a
+// thread while another file is on its stack: waits that ran other files' tasks nested
+// a file per wait until a large batch overflowed the stack.
+const int BATCH_CHECK_FILES = 2000;
+const size_t BATCH_CHECK_FILE_SIZE = 12 << 10;
+const uint32_t BATCH_CHECK_BLOCK_SIZE = 1 << 10;
+
+void checkBatch(ThreadPool& pool, const string& scratchDir, vector<string>& failures) {
+    static thread_local int filesOnStack = 0;
+    HuffmanOptions options;
+    options.pool = &pool;
+    options.threadCount = pool.size();
+    options.blockSize = BATCH_CHECK_BLOCK_SIZE;
+    atomic<int> nested(0), broken(0);
+    auto runFile = [&](int i) {
+        ++filesOnStack;
+        if (filesOnStack > 1) nested++;
+        mt19937_64 rng(uint64_t(i) + 1);
+        vector<uint8_t> data = generateText(BATCH_CHECK_FILE_SIZE, rng), restored;
+        string base = scratchDir + "/batch" + to_string(i);
+        bool ok = writeFile(base + ".raw", data) && compressDataFile(base + ".raw", base + ".huf", options) &&
+                  decompressDataFile(base + ".huf", base + ".out", options) && readFile(base + ".out", restored) &&
+                  restored == data;
+        if (!ok) broken++;
+        for (const char* suffix : {".raw", ".huf", ".out"}) filesystem::remove(base + suffix);
+        --filesOnStack;
+    };
+    TaskGroup files;
+    for (int i = 0; i < BATCH_CHECK_FILES; ++i) pool.submitRoot(files, [&runFile, i] { runFile(i); });
+    pool.wait(files);
+    string name = "batch of " + to_string(BATCH_CHECK_FILES) + " files, " + to_string(pool.size()) + " threads: ";
+    if (nested) failures.push_back(name + to_string(nested.load()) + " files started inside another file");
+    if (broken) failures.push_back(name + to_string(broken.load()) + " files did not round-trip");
+}
+
+void writeCsv(ostream& out, const vector<Result>& results) {
+    out << "corpus,stage,threads,block_kib,bytes,iterations,median_ms,p99_ms,mb_per_s,ratio\n";
+    for (const Result& result : results) {
+        double median = percentile(result.samples, 0.5);
+        out << result.corpus << ',' << result.stage << ',' << result.threads << ',' << result.blockKiB << ','
+            << result.bytes << ',' << result.samples.size() << ',' << median << ',' << percentile(result.samples, 0.99)
+            << ',' << (median > 0 ? result.bytes / median / 1e3 : 0) << ',' << result.ratio << '\n';
+    }
+}
+
+void writeJson(ostream& out, const vector<Result>& results) {
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& result = results[i];
+        double median = percentile(result.samples, 0.5);
+        out << "  {\"corpus\": \"" << result.corpus << "\", \"stage\": \"" << result.stage
+            << "\", \"threads\": " << result.threads << ", \"block_kib\": " << result.blockKiB
+            << ", \"bytes\": " << result.bytes << ", \"iterations\": " << result.samples.size()
+            << ", \"median_ms\": " << median << ", \"p99_ms\": " << percentile(result.samples, 0.99)
+            << ", \"mb_per_s\": " << (median > 0 ? result.bytes / median / 1e3 : 0) << ", \"ratio\": " << result.ratio
+            << '}' << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+}
+
+// Identifies a result across runs
+string resultKey(const string& corpus, const string& stage, int threads, uint32_t blockKiB) {
+    return corpus + "," + stage + "," + to_string(threads) + "," + to_string(blockKiB);
+}
+
+// Value of `"field": value` in one line of writeJson output, unquoted; empty if absent
+string jsonField(const string& line, const string& field) {
+    size_t at = line.find("\"" + field + "\": ");
+    if (at == string::npos) return "";
+    at += field.size() + 4;
+    if (at < line.size() && line[at] == '"') return line.substr(at + 1, line.find('"', at + 1) - at - 1);
+    return line.substr(at, line.find_first_of(",}", at) - at);
+}
+
+// MB/s per result key of an earlier -f json run
+bool loadBaseline(const string& path, map<string, double>& rates) {
+    ifstream input(path);
+    if (!input) return false;
+    for (string line; getline(input, line);) {
+        string rate = jsonField(line, "mb_per_s");
+        if (rate.empty()) continue;
+        rates[resultKey(jsonField(line, "corpus"), jsonField(line, "stage"), atoi(jsonField(line, "threads").c_str()),
+                        uint32_t(atoi(jsonField(line, "block_kib").c_str())))] = atof(rate.c_str());
+    }
+    return true;
+}
+
+// Report every result more than `tolerance` percent slower than its baseline; returns how many.
+// Stages missing from the baseline are new and pass.
+int countRegressions(const vector<Result>& results, const map<string, double>& baseline, double tolerance) {
+    int regressions = 0;
+    for (const Result& result : results) {
+        auto entry = baseline.find(resultKey(result.corpus, result.stage, result.threads, result.blockKiB));
+        double median = percentile(result.samples, 0.5);
+        if (entry == baseline.end() || median <= 0) continue;
+        double rate = result.bytes / median / 1e3;
+        if (rate >= entry->second * (1 - tolerance / 100)) continue;
+        cerr << "Regression: " << result.corpus << ' ' << result.stage << ", " << result.threads << " threads, "
+             << result.blockKiB << " KiB: " << rate << " MB/s against " << entry->second << " MB/s\n";
+        ++regressions;
+    }
+    return regressions;
+}
+
+// Benchmark harness: every stage over every corpus, thread count and block size
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        vector<long> values;
+        bool needsValue = arg == "-s" || arg == "-t" || arg == "-b" || arg == "-w" || arg == "-i" || arg == "-f" ||
+                          arg == "-o" || arg == "-e" || arg == "-k" || arg == "-z" || arg == "-B" || arg == "-T";
+        if (needsValue && i + 1 >= argc) {
+            cerr << "Error: " << arg << " needs a value.\n";
+            return 2;
+        }
+        if (arg == "-s" || arg == "-t" || arg == "-b" || arg == "-i") {
+            if (!parseList(argv[++i], values) || ((arg == "-s" || arg == "-i") && values.size() != 1)) {
+                cerr << "Error: " << arg << " needs positive numbers.\n";
+                return 2;
+            }
+            if (arg == "-s") config.corpusSize = size_t(values[0]) << 20;
+            if (arg == "-i") config.iterations = int(values[0]);
+            if (arg == "-t") config.threadCounts.assign(values.begin(), values.end());
+            if (arg == "-b") config.blockKiBs.assign(values.begin(), values.end());
+        } else if (arg == "-w") {
+            config.warmup = atoi(argv[++i]);
+        } else if (arg == "-f") {
+            string format = argv[++i];
+            if (format != "csv" && format != "json") {
+                cerr << "Error: Unknown format " << format << ".\n";
+                return 2;
+            }
+            config.json = format == "json";
+        } else if (arg == "-o") {
+            config.outputName = argv[++i];
+        } else if (arg == "-e") {
+            string engine = argv[++i];
+            if (engine != "order0" && engine != "lz77") {
+                cerr << "Error: Unknown engine " << engine << ".\n";
+                return 2;
+            }
+            config.engine = engine == "lz77" ? HuffmanEngine::Lz77 : HuffmanEngine::Order0;
+        } else if (arg == "-n") {
+            config.generated = false;
+        } else if (arg == "-p") {
+            config.pinned = true;
+        } else if (arg == "-k") {
+            string kernels = argv[++i];
+            if (kernels != "best" && kernels != "portable") {
+                cerr << "Error: Unknown kernels " << kernels << ".\n";
+                return 2;
+            }
+            config.kernels = kernels == "portable" ? HuffmanKernels::Portable : HuffmanKernels::Best;
+        } else if (arg == "-c") {
+            config.check = true;
+        } else if (arg == "-z") {
+            config.corruptions = atoi(argv[++i]);
+        } else if (arg == "-B") {
+            config.baselineName = argv[++i];
+        } else if (arg == "-T") {
+            config.tolerance = atof(argv[++i]);
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            cerr << "Error: Unknown option " << arg << ".\n";
+            printUsage();
+            return 2;
+        } else {
+            config.corpusFiles.push_back(arg);
+        }
+    }
+
+    vector<Corpus> corpora;
+    if (config.generated) corpora = generateCorpora(config.corpusSize);
+    for (const string& path : config.corpusFiles) {
+        Corpus corpus;
+        if (!loadCorpus(path, corpus)) {
+            cerr << "Error: Cannot read corpus '" << path << "'.\n";
+            return 2;
+        }
+        corpora.push_back(move(corpus));
+    }
+    if (corpora.empty()) {
+        printUsage();
+        return 2;
+    }
+
+    map<string, double> baseline;
+    if (!config.baselineName.empty() && !loadBaseline(config.baselineName, baseline)) {
+        cerr << "Error: Cannot read baseline '" << config.baselineName << "'.\n";
+        return 2;
+    }
+    selectKernels(config.kernels);
+    if (!config.check) cerr << "Kernels: " << kernelName() << '\n';
+
+    string scratchDir = (filesystem::temp_directory_path() / ("huffman-bench-" + to_string(high_resolution_clock::now().time_since_epoch().count()))).string();
+    filesystem::create_directories(scratchDir);
+    vector<Result> results;
+    map<string, vector<uint8_t>> references;
+    vector<string> failures;
+    bool ok = true;
+    if (config.check) checkStatsFormat(failures);
+    for (int threads : config.threadCounts) {
+        // One persistent pool per thread count, as the CLI uses
+        unique_ptr<ThreadPool> pool;
+        if (threads > 1) pool = make_unique<ThreadPool>(threads, config.pinned);
+        for (const Corpus& corpus : corpora) {
+            for (uint32_t blockKiB : config.blockKiBs) {
+                cerr << corpus.name << ": " << threads << " threads, " << blockKiB << " KiB blocks\n";
+                if (config.check) {
+                    checkCorpus(config, corpus, threads, blockKiB, pool.get(), scratchDir, references, failures);
+                } else {
+                    ok = ok && benchCorpus(config, corpus, threads, blockKiB, pool.get(), scratchDir, results);
+                }
+            }
+        }
+        if (config.check && pool) {
+            cerr << "batch: " << threads << " threads\n";
+            checkBatch(*pool, scratchDir, failures);
+        }
+    }
+    filesystem::remove_all(scratchDir);
+    if (config.check) {
+        for (const string& failure : failures) cerr << "FAILED " << failure << '\n';
+        cerr << (failures.empty() ? "All checks passed.\n" : to_string(failures.size()) + " checks failed.\n");
+        return failures.empty() ? 0 : 1;
+    }
+    if (!ok) {
+        cerr << "Error: Benchmark run failed.\n";
+        return 1;
+    }
+
+    ofstream fileOutput;
+    if (!config.outputName.empty()) fileOutput.open(config.outputName);
+    ostream& out = config.outputName.empty() ? cout : fileOutput;
+    if (config.json) {
+        writeJson(out, results);
+    } else {
+        writeCsv(out, results);
+    }
+    if (!out) return 1;
+    int regressions = baseline.empty() ? 0 : countRegressions(results, baseline, config.tolerance);
+    if (regressions) cerr << regressions << " stages slower than the baseline.\n";
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,3556 @@
+#include "HuffmanCodec.h"
+#include "ThreadPool.h"
+
+#include <iostream>
+#include <fstream>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string_view>
+#include <streambuf>
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP 1
+#define HAVE_PREAD 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_SSE42_CRC 1
+#define HAVE_BMI2_KERNELS 1
+#include <nmmintrin.h>
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+#define KERNEL_INLINE inline __attribute__((always_inline))
+#else
+#define KERNEL_INLINE inline
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+// Most requests the io_uring ring takes at once; 0 for its size. A build setting a small
+// limit sends the rest through the thread fallback, to exercise the two mixed.
+#ifndef HUFFMAN_IO_RING_LIMIT
+#define HUFFMAN_IO_RING_LIMIT 0
+#endif
+using namespace std;
+using namespace chrono;
+
+namespace {
+
+const uint64_t MIN_FRAME_BLOCKS = 4;
+// Histogram slice per pool task; enough work to amortise the submit
+const size_t HISTOGRAM_SLICE = 1 << 20;
+const uint64_t UNKNOWN_SIZE = ~uint64_t(0);
+const char CONTAINER_MAGIC[4] = {'H', 'U', 'F', 'B'};
+// Container whose block headers also carry the CRC32C of each block's raw bytes
+const char CHECKED_MAGIC[4] = {'H', 'U', 'F', 'C'};
+// Compact container of a single small dictionary-coded block, without and with its CRC32C
+const char COMPACT_MAGIC[4] = {'H', 'U', 'F', 'S'};
+const char COMPACT_CHECKED_MAGIC[4] = {'H', 'U', 'F', 'T'};
+const char DICTIONARY_MAGIC[4] = {'H', 'U', 'F', 'D'};
+const char FRAME_TERMINATOR[8] = {};
+
+// Huffman Tree Node in a flat array: leaves first, sorted by ascending frequency,
+// then internal nodes in merge order, so every parent index is above its children
+struct HuffmanNode {
+    uint64_t frequency;
+    uint16_t parent;
+    uint8_t symbol;
+};
+const int MAX_TREE_NODES = 2 * 256 - 1;
+
+// Packed bit output: MSB-first, 64-bit accumulator flushed in whole words
+struct BitWriter {
+    string& out;
+    uint64_t accumulator = 0;
+    int filled = 0;
+    uint64_t bitCount = 0;
+    explicit BitWriter(string& target) : out(target) {}
+
+    void flushWord() {
+        char word[8];
+        for (int i = 0; i < 8; ++i) word[i] = char(accumulator >> (56 - 8 * i));
+        out.append(word, sizeof(word));
+        accumulator = 0;
+        filled = 0;
+    }
+
+    // Append the low `length` bits of `value` (length < 64)
+    KERNEL_INLINE void writeBits(uint64_t value, int length) {
+        bitCount += length;
+        if (filled + length < 64) {
+            accumulator = (accumulator << length) | value;
+            filled += length;
+            return;
+        }
+        int head = 64 - filled;
+        int tail = length - head;
+        accumulator = (accumulator << head) | (value >> tail);
+        flushWord();
+        accumulator = value & ((uint64_t(1) << tail) - 1);
+        filled = tail;
+    }
+
+    // Pad the last partial word to a byte boundary and emit it
+    void finish() {
+        while (filled > 0) {
+            int take = filled >= 8 ? 8 : filled;
+            out += char((accumulator >> (filled - take)) << (8 - take));
+            filled -= take;
+        }
+        accumulator = 0;
+    }
+};
+
+// Packed bit input matching BitWriter, zero-padded past the end
+struct BitReader {
+    string_view data;
+    size_t bytePos;
+    uint64_t buffer = 0;
+    int available = 0;
+    KERNEL_INLINE BitReader(string_view source, uint64_t startBit) : data(source), bytePos(startBit / 8) {
+        refill();
+        consume(int(startBit % 8));
+    }
+
+    // Top up to at least 57 valid bits, a whole word at a time away from the end
+    KERNEL_INLINE void refill() {
+        if (available > 56) return;
+        if (bytePos + 8 <= data.size()) {
+            uint64_t word = 0;
+            for (int i = 0; i < 8; ++i) word = (word << 8) | (unsigned char)data[bytePos + i];
+            buffer |= word >> available;
+            int bytes = (64 - available) >> 3;
+            bytePos += bytes;
+            available += bytes * 8;
+            return;
+        }
+        while (available <= 56) {
+            uint64_t byte = bytePos < data.size() ? (unsigned char)data[bytePos] : 0;
+            buffer |= byte << (56 - available);
+            available += 8;
+            ++bytePos;
+        }
+    }
+
+    KERNEL_INLINE uint64_t peek(int count) const { return buffer >> (64 - count); }
+
+    KERNEL_INLINE void consume(int count) {
+        buffer <<= count;
+        available -= count;
+    }
+};
+
+// CRC32C (Castagnoli) of every block in checksummed containers: the SSE4.2 instruction
+// where the CPU has it, else slicing-by-8 tables
+struct Crc32cTables {
+    uint32_t table[8][256];
+    Crc32cTables() {
+        for (uint32_t byte = 0; byte < 256; ++byte) {
+            uint32_t crc = byte;
+            for (int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+            table[0][byte] = crc;
+        }
+        for (int k = 1; k < 8; ++k)
+            for (int byte = 0; byte < 256; ++byte)
+                table[k][byte] = (table[k - 1][byte] >> 8) ^ table[0][table[k - 1][byte] & 0xff];
+    }
+};
+
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t size) {
+    static const Crc32cTables tables;
+    const auto& t = tables.table;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | uint32_t(data[3]) << 24);
+        crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+              t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    while (size--) crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t size) {
+    uint64_t wide = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = uint32_t(wide);
+    while (size--) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const char* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+#ifdef HAVE_SSE42_CRC
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) return ~crc32cHardware(~0u, bytes, size);
+#endif
+    return ~crc32cSoftware(~0u, bytes, size);
+}
+
+// Occurrence count per byte value
+using Histogram = array<uint64_t, 256>;
+
+// Code length per byte value, 0 = symbol absent
+using CodeLengths = array<uint8_t, 256>;
+// Longest code carried in a HuffmanCode word (also within a refilled BitReader's peek)
+const int MAX_CODE_LENGTH = 32;
+const int MIN_CODE_LENGTH_CAP = 8;
+// Matches DEFAULT_MAX_CODE_LENGTH so every code of a default table resolves in one probe
+const int TABLE_BITS = 12;
+
+// Encoder code table entry: code value in the low `length` bits
+struct HuffmanCode {
+    uint32_t bits;
+    uint8_t length;
+};
+using CodeTable = array<HuffmanCode, 256>;
+
+// Canonical decoding state: per-length first code, count and symbol offset
+struct CanonicalTable {
+    uint64_t firstCode[MAX_CODE_LENGTH + 1] = {};
+    uint32_t count[MAX_CODE_LENGTH + 1] = {};
+    uint32_t offset[MAX_CODE_LENGTH + 1] = {};
+    char symbols[256] = {};
+    int maxLength = 0;
+};
+
+// Primary table slot: up to two symbols resolved by one TABLE_BITS probe.
+// length0 == 0 marks a prefix of a code longer than TABLE_BITS.
+struct DecodeEntry {
+    char symbol0, symbol1;
+    uint8_t length0, length;
+};
+
+struct DecodeTable {
+    DecodeEntry primary[1 << TABLE_BITS];
+    CanonicalTable canonical;
+};
+
+// A dictionary's code table in every form the frame coder needs
+struct PresetTable {
+    CodeLengths lengths{};
+    CodeTable codes;
+    DecodeTable decode;
+};
+
+// How a block is coded: a table of its own, the table most recently sent in the
+// frame (or the dictionary's before any), stored bytes, one repeated byte, or LZ77
+// sequences whose streams are coded on their own
+enum BlockMode : uint8_t { BLOCK_TABLE = 0, BLOCK_REPEAT = 1, BLOCK_RAW = 2, BLOCK_RLE = 3, BLOCK_LZ = 4 };
+const uint32_t PRESET_TABLE = ~uint32_t(0);
+
+// Coded blocks of at least INTERLEAVE_MIN_SIZE bytes are split into STREAM_COUNT equal
+// segments, each its own bitstream, so one thread decodes them as independent chains
+const int STREAM_COUNT = 4;
+const uint32_t INTERLEAVE_MIN_SIZE = 16 * 1024;
+
+int streamCountOf(uint32_t rawSize) {
+    return rawSize >= INTERLEAVE_MIN_SIZE ? STREAM_COUNT : 1;
+}
+
+// One independently decodable block: input range and its byte-aligned payload
+struct BlockInfo {
+    uint64_t rawOffset;
+    uint32_t rawSize;
+    uint64_t byteOffset;
+    uint64_t payloadBytes;
+    uint64_t streamBits[STREAM_COUNT]; // valid bits of each coded stream
+    BlockMode mode;
+    uint8_t symbol;    // the repeated byte of an RLE block
+    uint32_t table;    // frame table index, or PRESET_TABLE; for an LZ block its frame lzStreams entry
+    uint32_t checksum = 0; // CRC32C of the raw bytes, in checksummed containers
+};
+
+// LZ77 engine: a block is parsed into sequences of literals followed by a back-reference
+// into the block, and the literals, the sequence tokens and the match offsets become three
+// streams, each coded like a block of its own (table, raw or rle). Matches never leave
+// their block, so LZ blocks decode independently like the others.
+//
+// A token holds the literal count in its high nibble and the match length minus
+// LZ_MIN_MATCH in its low one; a nibble of 15 continues in bytes after the token, each
+// added, until one below 255. The literal count's bytes come first. Offsets are two
+// bytes, low first. The last sequence has no match when the block ends in literals.
+const int LZ_STREAMS = 3;
+enum LzStream { LZ_LITERALS = 0, LZ_TOKENS = 1, LZ_OFFSETS = 2 };
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_WINDOW = 1 << 16; // offsets below it fit two bytes
+const int LZ_HASH_BITS = 16;
+// Candidates tried per position; deeper chains find longer matches but parse slower
+const int LZ_CHAIN_DEPTH = 4;
+// Every 2^LZ_SKIP_SHIFT positions without a match the parse steps one byte further,
+// so data with nothing to match costs little
+const int LZ_SKIP_SHIFT = 5;
+// No stream is longer than its block plus a few bytes; checked before allocating
+const uint64_t LZ_STREAM_SLACK = 64;
+
+// The coded streams of one LZ block; stream byte offsets are relative to the block's payload
+struct LzStreams {
+    BlockInfo streams[LZ_STREAMS];
+    CodeLengths lengths[LZ_STREAMS];
+};
+
+// Whole-file memory mapping, read-only or pre-sized for writing.
+// open*() return false when mapping is unavailable so callers fall back to streams.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool openRead(const string& path) {
+#ifdef HAVE_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+            ::close(fd);
+            return false;
+        }
+        bool ok = map(fd, size_t(info.st_size), PROT_READ, MAP_PRIVATE);
+        ::close(fd);
+        if (ok && base) madvise(base, length, MADV_SEQUENTIAL);
+        return ok;
+#else
+        (void)path;
+        return false;
+#endif
+    }
+
+    // Create or truncate `path` to exactly `size` bytes and map it writable
+    bool createWrite(const string& path, uint64_t size) {
+#ifdef HAVE_MMAP
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0 && !S_ISREG(info.st_mode)) return false;
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = ftruncate(fd, off_t(size)) == 0 && map(fd, size_t(size), PROT_READ | PROT_WRITE, MAP_SHARED);
+        ::close(fd);
+        return ok;
+#else
+        (void)path;
+        (void)size;
+        return false;
+#endif
+    }
+
+    void close() {
+#ifdef HAVE_MMAP
+        if (base) munmap(base, length);
+#endif
+        base = nullptr;
+        length = 0;
+        mapped = false;
+    }
+
+    bool isOpen() const { return mapped; }
+    char* data() const { return base; }
+    size_t size() const { return length; }
+    string_view view() const { return string_view(base, length); }
+
+private:
+#ifdef HAVE_MMAP
+    bool map(int fd, size_t size, int protection, int flags) {
+        mapped = true;
+        if (size == 0) return true;
+        void* address = mmap(nullptr, size, protection, flags, fd, 0);
+        if (address == MAP_FAILED) {
+            mapped = false;
+            return false;
+        }
+        base = (char*)address;
+        length = size;
+        return true;
+    }
+#endif
+
+    char* base = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+};
+
+#ifdef HAVE_PREAD
+// Descriptor for positional I/O if `path` is a regular file, else -1 (pipes and devices use streams)
+int openRegular(const string& path, int flags) {
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0 && !S_ISREG(info.st_mode)) return -1;
+    return ::open(path.c_str(), flags, 0644);
+}
+#endif
+
+// Read-only streambuf over memory so the header parsers also work on mapped files
+class MemoryStreamBuf : public streambuf {
+public:
+    MemoryStreamBuf(const char* base, size_t size) {
+        char* begin = const_cast<char*>(base);
+        setg(begin, begin, begin + size);
+    }
+
+protected:
+    pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode) override {
+        char* origin = dir == ios_base::beg ? eback() : dir == ios_base::end ? egptr() : gptr();
+        if (off < eback() - origin || off > egptr() - origin) return pos_type(off_type(-1));
+        setg(eback(), origin + off, egptr());
+        return pos_type(gptr() - eback());
+    }
+
+    pos_type seekpos(pos_type pos, ios_base::openmode which) override {
+        return seekoff(off_type(pos), ios_base::beg, which);
+    }
+};
+
+// Histogram data[begin, end) into `hist`. Bytes are spread over four interleaved
+// sub-histograms so runs of one value don't stall on the same counter.
+void countHistogramRange(string_view data, size_t begin, size_t end, Histogram& hist) {
+    uint64_t counts[4][256] = {};
+    const unsigned char* bytes = (const unsigned char*)data.data();
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        counts[0][word & 0xff]++;
+        counts[1][(word >> 8) & 0xff]++;
+        counts[2][(word >> 16) & 0xff]++;
+        counts[3][(word >> 24) & 0xff]++;
+        counts[0][(word >> 32) & 0xff]++;
+        counts[1][(word >> 40) & 0xff]++;
+        counts[2][(word >> 48) & 0xff]++;
+        counts[3][word >> 56]++;
+    }
+    for (; i < end; ++i) counts[0][bytes[i]]++;
+    for (int sym = 0; sym < 256; ++sym)
+        hist[sym] += counts[0][sym] + counts[1][sym] + counts[2][sym] + counts[3][sym];
+}
+
+// Count frequency in chunks into the worker's own slot; the caller reduces the slots
+void countFrequencyThread(string_view data, Histogram& slot, size_t begin, size_t finish) {
+    slot.fill(0);
+    countHistogramRange(data, begin, finish, slot);
+}
+
+// Shape-independent canonical codes: ordered by length, ties broken by byte value
+void assignCanonicalCodes(const CodeLengths& lengths, CodeTable& codes) {
+    uint32_t lengthCount[MAX_CODE_LENGTH + 1] = {};
+    for (uint8_t len : lengths) lengthCount[len]++;
+    lengthCount[0] = 0;
+    uint32_t nextCode[MAX_CODE_LENGTH + 1] = {};
+    uint64_t code = 0;
+    for (int len = 1; len <= MAX_CODE_LENGTH; ++len) {
+        code = (code + lengthCount[len - 1]) << 1;
+        nextCode[len] = uint32_t(code);
+    }
+    for (int sym = 0; sym < 256; ++sym) {
+        int len = lengths[sym];
+        codes[sym] = HuffmanCode{len ? nextCode[len]++ : 0, uint8_t(len)};
+    }
+}
+
+// Rebuild decoding state from code lengths, no tree required
+bool buildCanonicalTable(const CodeLengths& lengths, CanonicalTable& table) {
+    table = CanonicalTable();
+    uint64_t kraft = 0;
+    for (uint8_t len : lengths) {
+        if (len > MAX_CODE_LENGTH) return false;
+        if (len) table.count[len]++, kraft += uint64_t(1) << (MAX_CODE_LENGTH - len);
+        if (len > table.maxLength) table.maxLength = len;
+    }
+    // Oversubscribed lengths would index past the primary table
+    if (kraft > (uint64_t(1) << MAX_CODE_LENGTH)) return false;
+    uint64_t code = 0;
+    for (int len = 1; len <= MAX_CODE_LENGTH; ++len) {
+        code = (code + table.count[len - 1]) << 1;
+        table.firstCode[len] = code;
+        table.offset[len] = table.offset[len - 1] + table.count[len - 1];
+    }
+    uint32_t filled[MAX_CODE_LENGTH + 1] = {};
+    for (int sym = 0; sym < 256; ++sym) {
+        int len = lengths[sym];
+        if (len) table.symbols[table.offset[len] + filled[len]++] = char(sym);
+    }
+    return true;
+}
+
+// Fill the primary table from canonical codes, pairing a second symbol where both fit
+bool buildDecodeTable(const CodeLengths& lengths, DecodeTable& table) {
+    if (!buildCanonicalTable(lengths, table.canonical)) return false;
+    const CanonicalTable& canon = table.canonical;
+    for (DecodeEntry& entry : table.primary) entry = DecodeEntry{0, 0, 0, 0};
+    for (int len = 1; len <= TABLE_BITS; ++len) {
+        for (uint32_t i = 0; i < canon.count[len]; ++i) {
+            uint32_t first = uint32_t(canon.firstCode[len] + i) << (TABLE_BITS - len);
+            uint32_t last = first + (1u << (TABLE_BITS - len));
+            char sym = canon.symbols[canon.offset[len] + i];
+            for (uint32_t idx = first; idx < last; ++idx)
+                table.primary[idx] = DecodeEntry{sym, 0, uint8_t(len), uint8_t(len)};
+        }
+    }
+    const uint32_t mask = (1u << TABLE_BITS) - 1;
+    for (uint32_t idx = 0; idx <= mask; ++idx) {
+        DecodeEntry& entry = table.primary[idx];
+        if (!entry.length0 || entry.length0 == TABLE_BITS) continue;
+        const DecodeEntry& next = table.primary[(idx << entry.length0) & mask];
+        if (next.length0 && next.length0 <= TABLE_BITS - entry.length0) {
+            entry.symbol1 = next.symbol0;
+            entry.length = uint8_t(entry.length0 + next.length0);
+        }
+    }
+    return true;
+}
+
+// Coding kernels are instantiated per code length limit and dispatched once per block.
+// A limit fixes how many codes fit between refills (decode) or in one 63-bit write
+// (encode), so those loops unroll, and up to TABLE_BITS the long-code search is gone.
+// Every limit is built for plain x86-64 and for BMI2, whose flag-free variable shifts
+// the bit reader and writer use throughout; the CPU picks one at run time.
+constexpr int KERNEL_LIMITS[] = {TABLE_BITS, 14, 18, 28, MAX_CODE_LENGTH};
+constexpr int KERNEL_COUNT = int(size(KERNEL_LIMITS));
+
+// Index of the smallest kernel limit covering `maxLength`
+int kernelIndex(int maxLength) {
+    int index = 0;
+    while (index + 1 < KERNEL_COUNT && KERNEL_LIMITS[index] < maxLength) ++index;
+    return index;
+}
+
+// Decode the next one or two symbols of a stream, at most `room`; returns how many,
+// 0 if the bits run out or hit an unassigned code
+template <int Limit>
+KERNEL_INLINE int decodeSymbols(const DecodeTable& table, BitReader& reader, uint64_t& remaining, char* out,
+                                ptrdiff_t room) {
+    reader.refill();
+    const DecodeEntry& entry = table.primary[reader.peek(TABLE_BITS)];
+    if (entry.length0) {
+        if (entry.length != entry.length0 && room >= 2 && entry.length <= remaining) {
+            out[0] = entry.symbol0;
+            out[1] = entry.symbol1;
+            reader.consume(entry.length);
+            remaining -= entry.length;
+            return 2;
+        }
+        if (entry.length0 > remaining) return 0;
+        out[0] = entry.symbol0;
+        reader.consume(entry.length0);
+        remaining -= entry.length0;
+        return 1;
+    }
+    if constexpr (Limit > TABLE_BITS) {
+        // Long code: canonical search over the lengths past the primary table
+        const CanonicalTable& canon = table.canonical;
+        for (int len = TABLE_BITS + 1; len <= canon.maxLength; ++len) {
+            uint64_t code = reader.peek(len);
+            if (code - canon.firstCode[len] < canon.count[len]) {
+                if (uint64_t(len) > remaining) return 0;
+                out[0] = canon.symbols[canon.offset[len] + (code - canon.firstCode[len])];
+                reader.consume(len);
+                remaining -= len;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Decode exactly `symbolCount` symbols from `bitCount` bits starting at `beginBit`.
+// Returns false if the bits run out or hit an unassigned code.
+template <int Limit>
+KERNEL_INLINE bool decodeBlockKernel(const DecodeTable& table, string_view packed, uint64_t beginBit,
+                                     uint64_t bitCount, char* out, size_t symbolCount) {
+    BitReader reader(packed, beginBit);
+    uint64_t remaining = bitCount;
+    char* end = out + symbolCount;
+    while (out < end) {
+        int decoded = decodeSymbols<Limit>(table, reader, remaining, out, end - out);
+        if (!decoded) return false;
+        out += decoded;
+    }
+    return true;
+}
+
+// Decode STREAM_COUNT consecutive streams starting at byte `byteOffset` into their
+// segments of `out`. The streams advance in lockstep so their table lookups and
+// shifts overlap instead of forming one serial chain; the tails finish one by one.
+template <int Limit>
+KERNEL_INLINE bool decodeInterleavedKernel(const DecodeTable& table, string_view packed, uint64_t byteOffset,
+                                           const uint64_t streamBits[STREAM_COUNT], char* out, size_t symbolCount) {
+    size_t segment = (symbolCount + STREAM_COUNT - 1) / STREAM_COUNT;
+    uint64_t offsets[STREAM_COUNT];
+    for (int s = 0; s < STREAM_COUNT; ++s) {
+        offsets[s] = byteOffset;
+        byteOffset += (streamBits[s] + 7) / 8;
+    }
+    BitReader readers[STREAM_COUNT] = {{packed, offsets[0] * 8}, {packed, offsets[1] * 8},
+                                       {packed, offsets[2] * 8}, {packed, offsets[3] * 8}};
+    uint64_t remaining[STREAM_COUNT];
+    char* pos[STREAM_COUNT];
+    char* end[STREAM_COUNT];
+    for (int s = 0; s < STREAM_COUNT; ++s) {
+        remaining[s] = streamBits[s];
+        pos[s] = out + min(s * segment, symbolCount);
+        end[s] = out + min((s + 1) * segment, symbolCount);
+    }
+
+    // Streams pair symbols at different rates, so every one needs room for `count`
+    auto roomInAll = [&](ptrdiff_t count) {
+        for (int s = 0; s < STREAM_COUNT; ++s)
+            if (end[s] - pos[s] < count) return false;
+        return true;
+    };
+    // A refill leaves at least 57 bits, enough for `lookups` codes of the longest length,
+    // so the bit budget is checked once per round instead of per symbol
+    const CanonicalTable& canon = table.canonical;
+    constexpr int lookups = 56 / max(TABLE_BITS, Limit);
+    while (roomInAll(2 * lookups)) {
+        uint64_t used[STREAM_COUNT] = {};
+        for (int s = 0; s < STREAM_COUNT; ++s) readers[s].refill();
+        for (int k = 0; k < lookups; ++k) {
+            for (int s = 0; s < STREAM_COUNT; ++s) {
+                const DecodeEntry& entry = table.primary[readers[s].peek(TABLE_BITS)];
+                if (entry.length0) {
+                    pos[s][0] = entry.symbol0;
+                    pos[s][1] = entry.symbol1;
+                    pos[s] += entry.length == entry.length0 ? 1 : 2;
+                    readers[s].consume(entry.length);
+                    used[s] += entry.length;
+                    continue;
+                }
+                if constexpr (Limit <= TABLE_BITS) {
+                    return false;
+                } else {
+                    int len = TABLE_BITS + 1;
+                    uint64_t code = 0;
+                    for (; len <= canon.maxLength; ++len) {
+                        code = readers[s].peek(len);
+                        if (code - canon.firstCode[len] < canon.count[len]) break;
+                    }
+                    if (len > canon.maxLength) return false;
+                    *pos[s]++ = canon.symbols[canon.offset[len] + (code - canon.firstCode[len])];
+                    readers[s].consume(len);
+                    used[s] += len;
+                }
+            }
+        }
+        for (int s = 0; s < STREAM_COUNT; ++s) {
+            if (used[s] > remaining[s]) return false;
+            remaining[s] -= used[s];
+        }
+    }
+    while (roomInAll(2)) {
+        for (int s = 0; s < STREAM_COUNT; ++s) {
+            int decoded = decodeSymbols<Limit>(table, readers[s], remaining[s], pos[s], 2);
+            if (!decoded) return false;
+            pos[s] += decoded;
+        }
+    }
+    for (int s = 0; s < STREAM_COUNT; ++s) {
+        while (pos[s] < end[s]) {
+            int decoded = decodeSymbols<Limit>(table, readers[s], remaining[s], pos[s], end[s] - pos[s]);
+            if (!decoded) return false;
+            pos[s] += decoded;
+        }
+    }
+    return true;
+}
+
+// Encode data[begin, end) into a byte-aligned packed bitstream, returns the number of valid bits.
+// Codes are gathered `batch` at a time into one word, one writer step per batch.
+template <int Limit>
+KERNEL_INLINE uint64_t huffmanEncodeKernel(string_view data, size_t begin, size_t end, const CodeTable& codeTable,
+                                           string& packed) {
+    packed.reserve(packed.size() + (end - begin));
+    BitWriter writer(packed);
+    const unsigned char* bytes = (const unsigned char*)data.data();
+    constexpr size_t batch = 63 / Limit;
+    size_t i = begin;
+    for (; i + batch <= end; i += batch) {
+        uint64_t bits = 0;
+        int length = 0;
+        for (size_t k = 0; k < batch; ++k) {
+            const HuffmanCode& code = codeTable[bytes[i + k]];
+            bits = (bits << code.length) | code.bits;
+            length += code.length;
+        }
+        writer.writeBits(bits, length);
+    }
+    for (; i < end; ++i) {
+        const HuffmanCode& code = codeTable[bytes[i]];
+        writer.writeBits(code.bits, code.length);
+    }
+    uint64_t bitCount = writer.bitCount;
+    writer.finish();
+    return bitCount;
+}
+
+// `return kernel<limit>(args)` for the limit at `index`
+#define DISPATCH_LIMIT(index, kernel, ...)                                 \
+    switch (index) {                                                       \
+    case 0: return kernel<KERNEL_LIMITS[0]>(__VA_ARGS__);                  \
+    case 1: return kernel<KERNEL_LIMITS[1]>(__VA_ARGS__);                  \
+    case 2: return kernel<KERNEL_LIMITS[2]>(__VA_ARGS__);                  \
+    case 3: return kernel<KERNEL_LIMITS[3]>(__VA_ARGS__);                  \
+    default: return kernel<KERNEL_LIMITS[KERNEL_COUNT - 1]>(__VA_ARGS__);  \
+    }
+
+// The kernels of one instruction set; `attributes` selects it
+#define DEFINE_KERNELS(suffix, attributes)                                                                     \
+    attributes bool decodeBlock##suffix(int index, const DecodeTable& table, string_view packed,                \
+                                        uint64_t beginBit, uint64_t bitCount, char* out, size_t symbolCount) { \
+        DISPATCH_LIMIT(index, decodeBlockKernel, table, packed, beginBit, bitCount, out, symbolCount)          \
+    }                                                                                                          \
+    attributes bool decodeInterleaved##suffix(int index, const DecodeTable& table, string_view packed,          \
+                                              uint64_t byteOffset, const uint64_t* streamBits, char* out,      \
+                                              size_t symbolCount) {                                            \
+        DISPATCH_LIMIT(index, decodeInterleavedKernel, table, packed, byteOffset, streamBits, out, symbolCount) \
+    }                                                                                                          \
+    attributes uint64_t huffmanEncode##suffix(int index, string_view data, size_t begin, size_t end,            \
+                                              const CodeTable& codes, string& packed) {                        \
+        DISPATCH_LIMIT(index, huffmanEncodeKernel, data, begin, end, codes, packed)                            \
+    }
+
+DEFINE_KERNELS(Generic, )
+#ifdef HAVE_BMI2_KERNELS
+DEFINE_KERNELS(Bmi2, __attribute__((target("bmi2"))))
+#endif
+#undef DEFINE_KERNELS
+#undef DISPATCH_LIMIT
+
+// Set by selectKernels to force the portable kernels
+atomic<bool> portableKernels(false);
+
+bool hasBmi2() {
+#ifdef HAVE_BMI2_KERNELS
+    static const bool supported = __builtin_cpu_supports("bmi2");
+    return supported && !portableKernels.load(memory_order_relaxed);
+#else
+    return false;
+#endif
+}
+
+#ifdef HAVE_BMI2_KERNELS
+#define CALL_KERNEL(name, ...) (hasBmi2() ? name##Bmi2(__VA_ARGS__) : name##Generic(__VA_ARGS__))
+#else
+#define CALL_KERNEL(name, ...) name##Generic(__VA_ARGS__)
+#endif
+
+bool decodeBlock(const DecodeTable& table, string_view packed, uint64_t beginBit, uint64_t bitCount, char* out,
+                 size_t symbolCount) {
+    return CALL_KERNEL(decodeBlock, kernelIndex(table.canonical.maxLength), table, packed, beginBit, bitCount, out,
+                       symbolCount);
+}
+
+bool decodeInterleaved(const DecodeTable& table, string_view packed, uint64_t byteOffset,
+                       const uint64_t streamBits[STREAM_COUNT], char* out, size_t symbolCount) {
+    return CALL_KERNEL(decodeInterleaved, kernelIndex(table.canonical.maxLength), table, packed, byteOffset,
+                       streamBits, out, symbolCount);
+}
+
+uint64_t huffmanEncode(string_view data, size_t begin, size_t end, const CodeTable& codeTable, string& packed) {
+    int maxLength = 0;
+    for (const HuffmanCode& code : codeTable) maxLength = max<int>(maxLength, code.length);
+    return CALL_KERNEL(huffmanEncode, kernelIndex(maxLength), data, begin, end, codeTable, packed);
+}
+#undef CALL_KERNEL
+
+// Fixed-width big-endian integers for the container header
+void putUint(string& out, uint64_t value, int bytes) {
+    for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) out += char(value >> shift);
+}
+
+uint64_t readUint(istream& inFile, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) value = (value << 8) | (unsigned char)inFile.get();
+    return value;
+}
+
+// Unsigned in 7-bit groups, low group first, the high bit set on all but the last byte
+void putVarint(string& out, uint64_t value) {
+    for (; value >= 0x80; value >>= 7) out += char(value | 0x80);
+    out += char(value);
+}
+
+size_t varintSize(uint64_t value) {
+    size_t bytes = 1;
+    for (; value >= 0x80; value >>= 7) ++bytes;
+    return bytes;
+}
+
+// Fails `input` on a truncated value or one past 64 bits
+uint64_t readVarint(istream& input) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = input.get();
+        if (byte == EOF || (shift == 63 && byte > 1)) break;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    input.setstate(ios::failbit);
+    return 0;
+}
+
+// Save code lengths: literal lengths, zero runs stored as 0 followed by run length - 1
+void putCodeLengths(string& out, const CodeLengths& lengths) {
+    for (int sym = 0; sym < 256;) {
+        if (lengths[sym]) {
+            out += char(lengths[sym++]);
+            continue;
+        }
+        int run = 0;
+        while (sym < 256 && !lengths[sym]) ++sym, ++run;
+        out += char(0);
+        out += char(run - 1);
+    }
+}
+
+// Bytes putCodeLengths stores for `lengths`
+size_t codeLengthsSize(const CodeLengths& lengths) {
+    size_t size = 0;
+    for (int sym = 0; sym < 256;) {
+        if (lengths[sym++]) {
+            ++size;
+            continue;
+        }
+        while (sym < 256 && !lengths[sym]) ++sym;
+        size += 2;
+    }
+    return size;
+}
+
+// Load code lengths
+bool readCodeLengths(istream& inFile, CodeLengths& lengths) {
+    lengths.fill(0);
+    for (int sym = 0; sym < 256;) {
+        int len = inFile.get();
+        if (len == EOF) return false;
+        if (len) {
+            lengths[sym++] = uint8_t(len);
+            continue;
+        }
+        int run = inFile.get();
+        if (run == EOF || sym + run + 1 > 256) return false;
+        sym += run + 1;
+    }
+    return true;
+}
+
+// Workers the current call may keep busy on its pool, 0 for all of them; set for the
+// calling thread by WorkerLimit, which is where parallelFor runs
+thread_local int callWorkerLimit = 0;
+
+class WorkerLimit {
+public:
+    explicit WorkerLimit(int workers) : previous(callWorkerLimit) { callWorkerLimit = workers; }
+    ~WorkerLimit() { callWorkerLimit = previous; }
+    WorkerLimit(const WorkerLimit&) = delete;
+    WorkerLimit& operator=(const WorkerLimit&) = delete;
+
+private:
+    int previous;
+};
+
+int workersOf(ThreadPool* pool) {
+    if (!pool) return 1;
+    return callWorkerLimit > 0 ? min(callWorkerLimit, pool->size()) : pool->size();
+}
+
+// Run body(i) for every i < count as pool tasks, inline without a pool. On a pool
+// spanning NUMA nodes consecutive i go to the same node, so neighbouring blocks and
+// the buffers they reuse from frame to frame stay on one node's memory. Under a
+// WorkerLimit at most that many tasks run, each taking the next i (a contiguous run
+// of them across nodes) until none is left.
+template <typename Body>
+void parallelFor(ThreadPool* pool, size_t count, const Body& body) {
+    if (!pool || count < 2) {
+        for (size_t i = 0; i < count; ++i) body(i);
+        return;
+    }
+    TaskGroup group;
+    int nodes = pool->nodeCount();
+    size_t workers = size_t(workersOf(pool));
+    if (workers < count && workers < size_t(pool->size())) {
+        atomic<size_t> next{0};
+        for (size_t t = 0; t < workers; ++t) {
+            if (nodes > 1) {
+                size_t begin = t * count / workers, end = (t + 1) * count / workers;
+                pool->submitToNode(group, int(t * size_t(nodes) / workers), t, [&body, begin, end] {
+                    for (size_t i = begin; i < end; ++i) body(i);
+                });
+            } else {
+                pool->submit(group, [&body, &next, count] {
+                    for (size_t i; (i = next.fetch_add(1, memory_order_relaxed)) < count;) body(i);
+                });
+            }
+        }
+        pool->wait(group);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (nodes > 1) {
+            pool->submitToNode(group, int(i * size_t(nodes) / count), i, [&body, i] { body(i); });
+        } else {
+            pool->submit(group, [&body, i] { body(i); });
+        }
+    }
+    pool->wait(group);
+}
+
+// Run body(i, node) for every i < count once on each NUMA node of the pool, by that
+// node's workers, for per-node copies of shared data; node 0 only without a pool
+template <typename Body>
+void parallelForEachNode(ThreadPool* pool, size_t count, const Body& body) {
+    if (!pool || pool->nodeCount() == 1) {
+        parallelFor(pool, count, [&body](size_t i) { body(i, 0); });
+        return;
+    }
+    TaskGroup group;
+    for (int node = 0; node < pool->nodeCount(); ++node)
+        for (size_t i = 0; i < count; ++i) pool->submitToNode(group, node, i, [&body, i, node] { body(i, node); }, true);
+    pool->wait(group);
+}
+
+// Start `task` on the pool, or run it right away without one
+void runAsync(ThreadPool* pool, TaskGroup& group, function<void()> task) {
+    if (pool) {
+        pool->submit(group, move(task));
+    } else {
+        task();
+    }
+}
+
+void waitFor(ThreadPool* pool, TaskGroup& group) {
+    if (pool) pool->wait(group);
+}
+
+// Counters shared by the tasks of one call, collected into HuffmanStats at its end
+struct StageCounters {
+    atomic<uint64_t> histogram{0}, table{0}, encode{0}, decode{0}, read{0}, write{0};
+    atomic<uint64_t> bytesIn{0}, bytesOut{0}, frames{0}, blocks{0};
+    atomic<uint64_t> peakQueued{0}, inFlight{0}, peakInFlight{0};
+};
+
+void raisePeak(atomic<uint64_t>& peak, uint64_t value) {
+    uint64_t seen = peak.load(memory_order_relaxed);
+    while (value > seen && !peak.compare_exchange_weak(seen, value, memory_order_relaxed)) {
+    }
+}
+
+// Sample the pool's queue as `submitting` more tasks go in
+void noteQueued(StageCounters* counters, ThreadPool* pool, size_t submitting) {
+    if (counters && pool && submitting > 1) raisePeak(counters->peakQueued, pool->queued() + submitting);
+}
+
+// A frame entering (+1) or leaving (-1) a streaming pipeline
+void noteInFlight(StageCounters* counters, int change) {
+    if (!counters) return;
+    uint64_t now = counters->inFlight.fetch_add(uint64_t(int64_t(change)), memory_order_relaxed) + change;
+    raisePeak(counters->peakInFlight, now);
+}
+
+// Adds the time until it goes out of scope to one stage; nothing without counters
+class StageTimer {
+public:
+    StageTimer(StageCounters* counters, atomic<uint64_t> StageCounters::*stage)
+        : slot(counters ? &(counters->*stage) : nullptr) {
+        if (slot) start = steady_clock::now();
+    }
+    ~StageTimer() {
+        if (slot)
+            slot->fetch_add(uint64_t(duration_cast<nanoseconds>(steady_clock::now() - start).count()),
+                            memory_order_relaxed);
+    }
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    atomic<uint64_t>* slot;
+    steady_clock::time_point start;
+};
+
+// One positional read or write; `result` is the byte count, or -errno, once done
+struct IoRequest {
+    int fd = -1;
+    char* buffer = nullptr;
+    size_t length = 0;
+    uint64_t offset = 0;
+    bool write = false;
+    bool done = true;
+    bool onRing = false; // taken by io_uring, else by the thread fallback
+    int64_t result = 0;
+    TaskGroup task; // thread fallback
+};
+
+// Blocking transfer of what is left of `request` after `result` bytes; stops at end of file
+void finishTransfer(IoRequest& request) {
+#ifdef HAVE_PREAD
+    while (request.result >= 0 && size_t(request.result) < request.length) {
+        char* at = request.buffer + request.result;
+        size_t left = request.length - size_t(request.result);
+        off_t offset = off_t(request.offset + uint64_t(request.result));
+        ssize_t n = request.write ? pwrite(request.fd, at, left, offset) : pread(request.fd, at, left, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) request.result = -errno;
+        if (n <= 0) return;
+        request.result += n;
+    }
+#else
+    request.result = -ENOSYS;
+#endif
+}
+
+// Positional file I/O with several requests in flight, so reads of later frames and
+// writes of earlier ones overlap coding. Uses io_uring when the kernel allows it,
+// else pool tasks doing pread/pwrite (inline without a pool). One thread submits
+// and waits; a request must stay alive until waited for.
+class AsyncIo {
+public:
+    AsyncIo(ThreadPool* pool, unsigned depth) : pool(pool) {
+#ifdef HAVE_IO_URING
+        ring.setup(depth);
+#else
+        (void)depth;
+#endif
+    }
+
+    bool usesUring() const {
+#ifdef HAVE_IO_URING
+        return ring.fd >= 0;
+#else
+        return false;
+#endif
+    }
+
+    void submit(IoRequest& request) {
+        request.done = false;
+        request.result = 0;
+        request.onRing = false;
+#ifdef HAVE_IO_URING
+        request.onRing = ring.fd >= 0 && ring.push(request);
+        if (request.onRing) return;
+#endif
+        if (pool) {
+            pool->submit(request.task, [&request] { finishTransfer(request); });
+            return;
+        }
+        finishTransfer(request);
+        request.done = true;
+    }
+
+    // Block until `request` is done; short transfers are completed synchronously. A request
+    // the ring refused is waited for on the pool, as no completion will come for it.
+    void wait(IoRequest& request) {
+#ifdef HAVE_IO_URING
+        if (request.onRing) {
+            while (!request.done) ring.reap(true);
+            // Kernels before 5.6 lack plain read/write opcodes
+            if (request.result == -EINVAL) request.result = 0;
+            finishTransfer(request);
+            return;
+        }
+#endif
+        if (pool && !request.done) pool->wait(request.task);
+        request.done = true;
+    }
+
+private:
+    ThreadPool* pool;
+#ifdef HAVE_IO_URING
+    // Submission and completion rings shared with the kernel, set up by raw syscalls
+    struct Ring {
+        int fd = -1;
+        unsigned entries = 0, inFlight = 0;
+        void* sqMap = nullptr;
+        void* cqMap = nullptr;
+        size_t sqMapSize = 0, cqMapSize = 0, sqeMapSize = 0;
+        unsigned *sqHead = nullptr, *sqTail = nullptr, *sqMask = nullptr, *sqArray = nullptr;
+        unsigned *cqHead = nullptr, *cqTail = nullptr, *cqMask = nullptr;
+        io_uring_sqe* sqes = nullptr;
+        io_uring_cqe* cqes = nullptr;
+
+        void setup(unsigned depth) {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            int ringFd = int(syscall(__NR_io_uring_setup, depth, &params));
+            if (ringFd < 0) return;
+            sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single) sqMapSize = cqMapSize = max(sqMapSize, cqMapSize);
+            sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+            cqMap = single || sqMap == MAP_FAILED
+                        ? sqMap
+                        : mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                               IORING_OFF_CQ_RING);
+            sqeMapSize = params.sq_entries * sizeof(io_uring_sqe);
+            void* sqeMap = sqMap == MAP_FAILED || cqMap == MAP_FAILED
+                               ? MAP_FAILED
+                               : mmap(nullptr, sqeMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                                      IORING_OFF_SQES);
+            fd = ringFd;
+            if (sqeMap == MAP_FAILED) {
+                release();
+                return;
+            }
+            char* sq = (char*)sqMap;
+            char* cq = (char*)cqMap;
+            sqHead = (unsigned*)(sq + params.sq_off.head);
+            sqTail = (unsigned*)(sq + params.sq_off.tail);
+            sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+            sqArray = (unsigned*)(sq + params.sq_off.array);
+            cqHead = (unsigned*)(cq + params.cq_off.head);
+            cqTail = (unsigned*)(cq + params.cq_off.tail);
+            cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+            sqes = (io_uring_sqe*)sqeMap;
+            entries = params.sq_entries;
+        }
+
+        // Queue and submit one request; false if the kernel refused it, or past
+        // HUFFMAN_IO_RING_LIMIT requests in flight when the build sets one
+        bool push(IoRequest& request) {
+#if HUFFMAN_IO_RING_LIMIT > 0
+            if (inFlight >= unsigned(HUFFMAN_IO_RING_LIMIT)) return false;
+#endif
+            while (inFlight >= entries) reap(true);
+            unsigned tail = *sqTail;
+            unsigned index = tail & *sqMask;
+            io_uring_sqe& sqe = sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe.fd = request.fd;
+            sqe.addr = uint64_t(uintptr_t(request.buffer));
+            sqe.len = unsigned(min<size_t>(request.length, 1u << 30));
+            sqe.off = request.offset;
+            sqe.user_data = uint64_t(uintptr_t(&request));
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            if (syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0) != 1) {
+                __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+                return false;
+            }
+            ++inFlight;
+            return true;
+        }
+
+        // Mark every posted completion done, first sleeping for one if `block`
+        void reap(bool block) {
+            unsigned head = *cqHead;
+            if (block && head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+                syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            for (; head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE); ++head) {
+                const io_uring_cqe& cqe = cqes[head & *cqMask];
+                IoRequest& request = *(IoRequest*)uintptr_t(cqe.user_data);
+                request.result = cqe.res;
+                request.done = true;
+                --inFlight;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+
+        void release() {
+            if (sqes) munmap(sqes, sqeMapSize);
+            if (cqMap && cqMap != MAP_FAILED && cqMap != sqMap) munmap(cqMap, cqMapSize);
+            if (sqMap && sqMap != MAP_FAILED) munmap(sqMap, sqMapSize);
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+
+        ~Ring() {
+            while (fd >= 0 && inFlight) reap(true);
+            release();
+        }
+    } ring;
+#endif
+};
+
+// Count frequencies of a whole buffer in pool-sized slices, each into its own slot
+void countFrequencies(string_view data, ThreadPool* pool, Histogram& hist) {
+    size_t sliceCount = (data.size() + HISTOGRAM_SLICE - 1) / HISTOGRAM_SLICE;
+    sliceCount = pool ? min(sliceCount, 4 * size_t(workersOf(pool))) : 1;
+    if (sliceCount <= 1) {
+        countHistogramRange(data, 0, data.size(), hist);
+        return;
+    }
+    vector<Histogram> slots(sliceCount);
+    parallelFor(pool, sliceCount, [&](size_t i) {
+        countFrequencyThread(data, slots[i], data.size() * i / sliceCount, data.size() * (i + 1) / sliceCount);
+    });
+    for (const Histogram& slot : slots)
+        for (int sym = 0; sym < 256; ++sym) hist[sym] += slot[sym];
+}
+
+// Build Huffman Tree and keep only its code lengths
+// Clamp code lengths to maxLength and repair the Kraft sum by lengthening the
+// longest codes below the cap, then hand the shortest lengths back to the most
+// frequent symbols. Cheap heuristic, close to package-merge for byte alphabets.
+void limitCodeLengths(const Histogram& hist, CodeLengths& codeLengths, int maxLength) {
+    uint32_t lengthCount[MAX_CODE_LENGTH + 1] = {};
+    bool overLimit = false;
+    for (uint8_t len : codeLengths) {
+        if (!len) continue;
+        overLimit |= len > maxLength;
+        lengthCount[min<int>(len, maxLength)]++;
+    }
+    if (!overLimit) return;
+
+    uint64_t kraft = 0;
+    for (int len = 1; len <= maxLength; ++len) kraft += uint64_t(lengthCount[len]) << (maxLength - len);
+    while (kraft > (uint64_t(1) << maxLength)) {
+        lengthCount[maxLength]--;
+        for (int len = maxLength - 1; len > 0; --len) {
+            if (lengthCount[len]) {
+                lengthCount[len]--;
+                lengthCount[len + 1] += 2;
+                break;
+            }
+        }
+        kraft--;
+    }
+
+    uint8_t order[256];
+    int used = 0;
+    for (int sym = 0; sym < 256; ++sym)
+        if (codeLengths[sym]) order[used++] = uint8_t(sym);
+    sort(order, order + used, [&](uint8_t a, uint8_t b) { return hist[a] != hist[b] ? hist[a] > hist[b] : a < b; });
+    int next = 0;
+    for (int len = 1; len <= maxLength; ++len)
+        for (uint32_t i = 0; i < lengthCount[len]; ++i) codeLengths[order[next++]] = uint8_t(len);
+}
+
+// Two-queue Huffman construction over sorted leaves in a fixed node array:
+// merged nodes come out in nondecreasing weight order, so no heap and no allocation
+void buildCodeLengths(const Histogram& hist, CodeLengths& codeLengths, int maxLength) {
+    HuffmanNode nodes[MAX_TREE_NODES];
+    int leafCount = 0;
+    for (int sym = 0; sym < 256; ++sym)
+        if (hist[sym]) nodes[leafCount++] = HuffmanNode{hist[sym], 0, uint8_t(sym)};
+    codeLengths.fill(0);
+    if (leafCount < 2) return;
+    sort(nodes, nodes + leafCount, [](const HuffmanNode& a, const HuffmanNode& b) {
+        return a.frequency != b.frequency ? a.frequency < b.frequency : a.symbol < b.symbol;
+    });
+
+    int nextLeaf = 0, nextInternal = leafCount, nodeCount = leafCount;
+    auto takeSmallest = [&]() {
+        if (nextLeaf < leafCount && (nextInternal == nodeCount || nodes[nextLeaf].frequency <= nodes[nextInternal].frequency))
+            return nextLeaf++;
+        return nextInternal++;
+    };
+    while (nodeCount < 2 * leafCount - 1) {
+        int left = takeSmallest();
+        int right = takeSmallest();
+        nodes[nodeCount] = HuffmanNode{nodes[left].frequency + nodes[right].frequency, 0, 0};
+        nodes[left].parent = nodes[right].parent = uint16_t(nodeCount);
+        ++nodeCount;
+    }
+
+    // Depths top-down: the root is last and parents always sit above their children
+    uint8_t depth[MAX_TREE_NODES];
+    depth[nodeCount - 1] = 0;
+    for (int i = nodeCount - 2; i >= 0; --i) depth[i] = uint8_t(depth[nodes[i].parent] + 1);
+    for (int i = 0; i < leafCount; ++i) codeLengths[nodes[i].symbol] = depth[i];
+    limitCodeLengths(hist, codeLengths, maxLength);
+}
+
+// One frame of the container: a run of blocks, each coded its own way
+struct EncodedFrame {
+    uint64_t rawSize = 0;
+    bool checksums = false;
+    vector<BlockInfo> blocks;
+    vector<CodeLengths> tables; // in the order BLOCK_TABLE blocks send them
+    vector<string> parts;       // one payload per block
+    vector<LzStreams> lzStreams; // per block when the LZ engine is on
+};
+
+// Exact payload bits of a block coded with `lengths`; UINT64_MAX if a present byte has no code
+uint64_t codedBits(const Histogram& hist, const CodeLengths& lengths) {
+    uint64_t bits = 0;
+    for (int sym = 0; sym < 256; ++sym) {
+        if (!hist[sym]) continue;
+        if (!lengths[sym]) return UINT64_MAX;
+        bits += hist[sym] * lengths[sym];
+    }
+    return bits;
+}
+
+// Pick the cheapest mode for one block from its histogram and return its cost in bits.
+// Costs count the header too: stream bit counts and, for a new table, its serialized
+// lengths. Ties go to the mode that is cheaper to decode (repeat, then table, then raw).
+uint64_t chooseBlockMode(const Histogram& hist, int maxCodeLength, const CodeLengths* previous, BlockInfo& block,
+                         CodeLengths& ownLengths, string& scratch) {
+    int distinct = 0, lastSymbol = 0;
+    for (int sym = 0; sym < 256; ++sym)
+        if (hist[sym]) ++distinct, lastSymbol = sym;
+    if (distinct == 1) {
+        block.mode = BLOCK_RLE;
+        block.symbol = uint8_t(lastSymbol);
+        return 8;
+    }
+
+    uint64_t rawCost = uint64_t(block.rawSize) * 8;
+    uint64_t countBits = 64 * uint64_t(streamCountOf(block.rawSize));
+    uint64_t repeatCost = UINT64_MAX;
+    if (previous) {
+        uint64_t bits = codedBits(hist, *previous);
+        if (bits != UINT64_MAX) repeatCost = bits + countBits;
+    }
+    buildCodeLengths(hist, ownLengths, maxCodeLength);
+    scratch.clear();
+    putCodeLengths(scratch, ownLengths);
+    uint64_t tableCost = codedBits(hist, ownLengths) + countBits + 8 * scratch.size();
+
+    if (repeatCost <= tableCost && repeatCost <= rawCost) {
+        block.mode = BLOCK_REPEAT;
+        return repeatCost;
+    }
+    if (tableCost <= rawCost) {
+        block.mode = BLOCK_TABLE;
+        return tableCost;
+    }
+    block.mode = BLOCK_RAW;
+    return rawCost;
+}
+
+// Fill a block's payload for its chosen mode; coded blocks get one stream per segment
+void encodeBlock(string_view data, const CodeTable* codes, BlockInfo& block, string& part) {
+    part.clear();
+    if (block.mode == BLOCK_RAW) {
+        part.assign(data.substr(block.rawOffset, block.rawSize));
+    } else if (block.mode != BLOCK_RLE) {
+        int streams = streamCountOf(block.rawSize);
+        size_t segment = (block.rawSize + streams - 1) / streams;
+        for (int s = 0; s < streams; ++s) {
+            size_t begin = block.rawOffset + min<size_t>(s * segment, block.rawSize);
+            size_t end = block.rawOffset + min<size_t>((s + 1) * segment, block.rawSize);
+            block.streamBits[s] = huffmanEncode(data, begin, end, *codes, part);
+        }
+    }
+    block.payloadBytes = part.size();
+}
+
+void putLzLength(string& tokens, size_t extra) {
+    for (; extra >= 255; extra -= 255) tokens += char(255);
+    tokens += char(extra);
+}
+
+// Bytes shared by the sequences at `a` and `b`, at most `limit`
+size_t matchLength(const unsigned char* a, const unsigned char* b, size_t limit) {
+    size_t length = 0;
+    for (; length + 8 <= limit; length += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + length, 8);
+        memcpy(&y, b + length, 8);
+        // Little-endian loads: the lowest differing bit is in the first differing byte
+        if (x != y && endian::native == endian::little) return length + size_t(countr_zero(x ^ y) / 8);
+        if (x != y) break;
+    }
+    while (length < limit && a[length] == b[length]) ++length;
+    return length;
+}
+
+// Greedy parse with hash chains over the block's earlier 4-byte sequences
+void lzParse(string_view block, string streams[LZ_STREAMS]) {
+    static thread_local vector<uint32_t> head, chain;
+    const uint32_t NONE = UINT32_MAX;
+    head.assign(size_t(1) << LZ_HASH_BITS, NONE);
+    chain.resize(LZ_WINDOW);
+    const unsigned char* bytes = (const unsigned char*)block.data();
+    size_t size = block.size();
+    auto hashAt = [&](size_t i) {
+        uint32_t word;
+        memcpy(&word, bytes + i, 4);
+        return (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+    };
+    auto insert = [&](size_t i) {
+        uint32_t& bucket = head[hashAt(i)];
+        chain[i % LZ_WINDOW] = bucket;
+        bucket = uint32_t(i);
+    };
+    size_t anchor = 0, i = 0, misses = 0;
+    auto emit = [&](size_t length, size_t offset) {
+        size_t literalCount = i - anchor;
+        streams[LZ_LITERALS].append(block.data() + anchor, literalCount);
+        size_t lengthCode = length ? length - LZ_MIN_MATCH : 0;
+        streams[LZ_TOKENS] += char(min<size_t>(literalCount, 15) << 4 | min<size_t>(lengthCode, 15));
+        if (literalCount >= 15) putLzLength(streams[LZ_TOKENS], literalCount - 15);
+        if (!length) return;
+        if (lengthCode >= 15) putLzLength(streams[LZ_TOKENS], lengthCode - 15);
+        streams[LZ_OFFSETS] += char(offset);
+        streams[LZ_OFFSETS] += char(offset >> 8);
+    };
+    while (i + LZ_MIN_MATCH <= size) {
+        size_t best = 0, bestOffset = 0;
+        uint32_t candidate = head[hashAt(i)];
+        for (int depth = 0; depth < LZ_CHAIN_DEPTH && candidate != NONE && i - candidate < LZ_WINDOW; ++depth) {
+            // Only a candidate that also matches the byte past the best so far can beat it
+            if (best < size - i && bytes[candidate + best] == bytes[i + best]) {
+                size_t length = matchLength(bytes + candidate, bytes + i, size - i);
+                if (length > best) best = length, bestOffset = i - candidate;
+            }
+            uint32_t next = chain[candidate % LZ_WINDOW];
+            // A slot reused by a later position ends the chain
+            if (next >= candidate) break;
+            candidate = next;
+        }
+        if (best < LZ_MIN_MATCH) {
+            insert(i);
+            i += 1 + (misses++ >> LZ_SKIP_SHIFT);
+            continue;
+        }
+        misses = 0;
+        emit(best, bestOffset);
+        // Positions inside a match are skipped; its last two keep the chains fed
+        size_t end = i + best;
+        insert(i);
+        for (i = max(i + 1, end - 2); i < end; ++i)
+            if (i + 4 <= size) insert(i);
+        anchor = i;
+    }
+    i = size;
+    if (anchor < size) emit(0, 0);
+}
+
+// Header bytes of an LZ block after its mode byte: per stream its size, mode and fields
+size_t lzHeaderSize(const LzStreams& lz) {
+    size_t total = 0;
+    for (int s = 0; s < LZ_STREAMS; ++s) {
+        const BlockInfo& stream = lz.streams[s];
+        total += 4 + 1;
+        if (stream.mode == BLOCK_TABLE) total += codeLengthsSize(lz.lengths[s]) + 8 * streamCountOf(stream.rawSize);
+        if (stream.mode == BLOCK_RLE) total += 1;
+    }
+    return total;
+}
+
+void putLzHeader(string& out, const LzStreams& lz) {
+    for (int s = 0; s < LZ_STREAMS; ++s) {
+        const BlockInfo& stream = lz.streams[s];
+        putUint(out, stream.rawSize, 4);
+        out += char(stream.mode);
+        if (stream.mode == BLOCK_TABLE) {
+            putCodeLengths(out, lz.lengths[s]);
+            for (int k = 0; k < streamCountOf(stream.rawSize); ++k) putUint(out, stream.streamBits[k], 8);
+        }
+        if (stream.mode == BLOCK_RLE) out += char(stream.symbol);
+    }
+}
+
+// Parse a block and code its streams into `part`; returns the block's cost in bits
+// after its mode byte, comparable with chooseBlockMode's
+uint64_t encodeLzBlock(string_view block, int maxCodeLength, LzStreams& lz, string& part) {
+    static thread_local string streams[LZ_STREAMS], coded, scratch;
+    for (string& stream : streams) stream.clear();
+    lzParse(block, streams);
+    part.clear();
+    for (int s = 0; s < LZ_STREAMS; ++s) {
+        string_view data = streams[s];
+        BlockInfo& stream = lz.streams[s];
+        stream = BlockInfo{0, uint32_t(data.size()), part.size(), 0, {}, BLOCK_RAW, 0, PRESET_TABLE};
+        CodeTable codes;
+        if (!data.empty()) {
+            Histogram hist{};
+            countHistogramRange(data, 0, data.size(), hist);
+            chooseBlockMode(hist, maxCodeLength, nullptr, stream, lz.lengths[s], scratch);
+            if (stream.mode == BLOCK_TABLE) assignCanonicalCodes(lz.lengths[s], codes);
+        }
+        encodeBlock(data, &codes, stream, coded);
+        stream.byteOffset = part.size();
+        part += coded;
+    }
+    return 8 * (lzHeaderSize(lz) + part.size());
+}
+
+// Undo lzParse; false on any stream running short, leftover or an offset before the block
+bool lzDecode(const string_view streams[LZ_STREAMS], char* out, size_t size) {
+    string_view literals = streams[LZ_LITERALS], tokens = streams[LZ_TOKENS], offsets = streams[LZ_OFFSETS];
+    size_t literal = 0, token = 0, offset = 0;
+    char* pos = out;
+    char* end = out + size;
+    auto readLength = [&](size_t& value) {
+        unsigned char next;
+        do {
+            if (token == tokens.size()) return false;
+            next = (unsigned char)tokens[token++];
+            value += next;
+        } while (next == 255);
+        return true;
+    };
+    while (pos < end) {
+        if (token == tokens.size()) return false;
+        unsigned char code = (unsigned char)tokens[token++];
+        size_t literalCount = code >> 4;
+        if (literalCount == 15 && !readLength(literalCount)) return false;
+        if (literalCount > size_t(end - pos) || literalCount > literals.size() - literal) return false;
+        memcpy(pos, literals.data() + literal, literalCount);
+        pos += literalCount;
+        literal += literalCount;
+        if (pos == end) break;
+
+        size_t length = code & 15;
+        if (length == 15 && !readLength(length)) return false;
+        length += LZ_MIN_MATCH;
+        if (offsets.size() - offset < 2) return false;
+        size_t distance = (unsigned char)offsets[offset] | size_t((unsigned char)offsets[offset + 1]) << 8;
+        offset += 2;
+        if (distance == 0 || distance > size_t(pos - out) || length > size_t(end - pos)) return false;
+        // Copies overlap when the distance is short; 8-byte steps are safe from 8 on
+        const char* from = pos - distance;
+        if (distance >= 8)
+            for (; length >= 8; length -= 8, pos += 8, from += 8) memcpy(pos, from, 8);
+        while (length--) *pos++ = *from++;
+    }
+    return literal == literals.size() && token == tokens.size() && offset == offsets.size();
+}
+
+// Decode an LZ block's streams into per-thread scratch (raw streams are used in place),
+// then its sequences into `out`
+bool decodeLzBlock(const LzStreams& lz, string_view payload, uint64_t byteOffset, char* out, uint32_t rawSize) {
+    static thread_local string decoded[LZ_STREAMS];
+    static thread_local unique_ptr<DecodeTable> table;
+    if (!table) table = make_unique<DecodeTable>();
+    string_view views[LZ_STREAMS];
+    for (int s = 0; s < LZ_STREAMS; ++s) {
+        const BlockInfo& stream = lz.streams[s];
+        uint64_t at = byteOffset + stream.byteOffset;
+        if (stream.mode == BLOCK_RAW) {
+            views[s] = payload.substr(at, stream.rawSize);
+            continue;
+        }
+        decoded[s].resize(stream.rawSize);
+        char* target = &decoded[s][0];
+        if (stream.mode == BLOCK_RLE) {
+            memset(target, stream.symbol, stream.rawSize);
+        } else {
+            if (!buildDecodeTable(lz.lengths[s], *table)) return false;
+            bool valid = streamCountOf(stream.rawSize) == STREAM_COUNT
+                             ? decodeInterleaved(*table, payload, at, stream.streamBits, target, stream.rawSize)
+                             : decodeBlock(*table, payload, at * 8, stream.streamBits[0], target, stream.rawSize);
+            if (!valid) return false;
+        }
+        views[s] = decoded[s];
+    }
+    return lzDecode(views, out, rawSize);
+}
+
+// How a container's frames are coded: its block size, code length cap, the dictionary
+// table if any, whether blocks carry checksums and whether LZ blocks are tried
+struct EncodeSettings {
+    uint32_t blockSize;
+    int maxCodeLength;
+    const PresetTable* preset;
+    bool checksums;
+    bool lz;
+};
+
+// Working buffers of encodeFrame, kept by callers coding frame after frame so each
+// call reuses the last one's allocations
+struct EncodeScratch {
+    vector<Histogram> hists;
+    vector<uint64_t> lzCosts;
+    vector<CodeTable> codes; // per table the frame sends, in frame.tables order
+    CodeLengths ownLengths;
+    string modeScratch;
+};
+
+// Encode a frame. Without a preset, blocks go in windows of a few per worker:
+// histograms (and LZ parses) in parallel, modes chosen in order (a repeat depends on
+// the table before it), then payloads in parallel. With a preset every block uses its
+// codes, skipping histogram and tree, and falls back to raw if that doesn't pay.
+void encodeFrame(string_view data, const EncodeSettings& settings, ThreadPool* pool, EncodedFrame& frame,
+                 EncodeScratch& scratch, StageCounters* counters) {
+    uint32_t blockSize = settings.blockSize;
+    const PresetTable* preset = settings.preset;
+    frame.rawSize = data.size();
+    frame.checksums = settings.checksums;
+    frame.blocks.clear();
+    frame.tables.clear();
+    for (size_t offset = 0; offset < data.size(); offset += blockSize)
+        frame.blocks.push_back(
+            BlockInfo{offset, uint32_t(min<size_t>(blockSize, data.size() - offset)), 0, 0, {}, BLOCK_REPEAT, 0, PRESET_TABLE});
+    frame.parts.resize(frame.blocks.size());
+    for (string& part : frame.parts) part.clear();
+    if (counters) {
+        counters->frames++;
+        counters->blocks += frame.blocks.size();
+    }
+
+    if (preset) {
+        noteQueued(counters, pool, frame.blocks.size());
+        parallelFor(pool, frame.blocks.size(), [&](size_t i) {
+            StageTimer timer(counters, &StageCounters::encode);
+            BlockInfo& block = frame.blocks[i];
+            if (frame.checksums) block.checksum = crc32c(data.data() + block.rawOffset, block.rawSize);
+            encodeBlock(data, &preset->codes, block, frame.parts[i]);
+            if (frame.parts[i].size() >= block.rawSize) {
+                block.mode = BLOCK_RAW;
+                encodeBlock(data, nullptr, block, frame.parts[i]);
+            }
+        });
+        return;
+    }
+
+    size_t window = pool ? 4 * size_t(workersOf(pool)) : MIN_FRAME_BLOCKS;
+    vector<Histogram>& hists = scratch.hists;
+    vector<uint64_t>& lzCosts = scratch.lzCosts;
+    vector<CodeTable>& codes = scratch.codes;
+    hists.resize(min(window, frame.blocks.size()));
+    lzCosts.resize(hists.size());
+    codes.clear();
+    frame.lzStreams.resize(settings.lz ? frame.blocks.size() : 0);
+    for (size_t first = 0; first < frame.blocks.size(); first += window) {
+        size_t count = min(window, frame.blocks.size() - first);
+        noteQueued(counters, pool, count);
+        parallelFor(pool, count, [&](size_t i) {
+            const BlockInfo& block = frame.blocks[first + i];
+            {
+                StageTimer timer(counters, &StageCounters::histogram);
+                countFrequencyThread(data, hists[i], block.rawOffset, block.rawOffset + block.rawSize);
+            }
+            lzCosts[i] = UINT64_MAX;
+            if (!settings.lz || count_if(hists[i].begin(), hists[i].end(), [](uint64_t n) { return n; }) < 2) return;
+            // The candidate goes straight to the block's part; the encode pass replaces it if not chosen
+            StageTimer timer(counters, &StageCounters::encode);
+            lzCosts[i] = encodeLzBlock(data.substr(block.rawOffset, block.rawSize), settings.maxCodeLength,
+                                       frame.lzStreams[first + i], frame.parts[first + i]);
+        });
+        {
+            StageTimer timer(counters, &StageCounters::table);
+            for (size_t i = 0; i < count; ++i) {
+                BlockInfo& block = frame.blocks[first + i];
+                const CodeLengths* previous = frame.tables.empty() ? nullptr : &frame.tables.back();
+                BlockInfo plain = block;
+                uint64_t cost = chooseBlockMode(hists[i], settings.maxCodeLength, previous, plain, scratch.ownLengths,
+                                                scratch.modeScratch);
+                if (lzCosts[i] < cost) {
+                    block.mode = BLOCK_LZ;
+                    block.table = uint32_t(first + i);
+                    block.payloadBytes = frame.parts[first + i].size();
+                    continue;
+                }
+                block = plain;
+                if (block.mode == BLOCK_TABLE) {
+                    frame.tables.push_back(scratch.ownLengths);
+                    codes.emplace_back();
+                    assignCanonicalCodes(scratch.ownLengths, codes.back());
+                }
+                if (block.mode == BLOCK_TABLE || block.mode == BLOCK_REPEAT)
+                    block.table = uint32_t(frame.tables.size() - 1);
+            }
+        }
+        noteQueued(counters, pool, count);
+        parallelFor(pool, count, [&](size_t i) {
+            StageTimer timer(counters, &StageCounters::encode);
+            BlockInfo& block = frame.blocks[first + i];
+            if (frame.checksums) block.checksum = crc32c(data.data() + block.rawOffset, block.rawSize);
+            if (block.mode == BLOCK_LZ) return;
+            encodeBlock(data, block.table == PRESET_TABLE ? nullptr : &codes[block.table], block, frame.parts[first + i]);
+        });
+    }
+}
+
+// Frame: raw size, then per block its mode byte and
+//   table:  code lengths, stream bit counts    repeat: stream bit counts
+//   raw:    nothing                            rle:    the byte
+//   lz:     per stream its size, mode byte and that mode's fields (table, raw or rle)
+// then its checksum if the container has them, followed by the block payloads.
+// A compact container's frame has no raw size (the header's) and varint bit counts.
+void putFrameHeader(string& out, const EncodedFrame& frame, bool compact = false) {
+    if (!compact) putUint(out, frame.rawSize, 8);
+    for (const BlockInfo& block : frame.blocks) {
+        out += char(block.mode);
+        if (block.mode == BLOCK_TABLE) putCodeLengths(out, frame.tables[block.table]);
+        if (block.mode == BLOCK_TABLE || block.mode == BLOCK_REPEAT)
+            for (int s = 0; s < streamCountOf(block.rawSize); ++s) {
+                if (compact)
+                    putVarint(out, block.streamBits[s]);
+                else
+                    putUint(out, block.streamBits[s], 8);
+            }
+        if (block.mode == BLOCK_RLE) out += char(block.symbol);
+        if (block.mode == BLOCK_LZ) putLzHeader(out, frame.lzStreams[block.table]);
+        if (frame.checksums) putUint(out, block.checksum, 4);
+    }
+}
+
+size_t payloadSize(const EncodedFrame& frame) {
+    size_t total = 0;
+    for (const string& part : frame.parts) total += part.size();
+    return total;
+}
+
+// Write a frame and return its size
+uint64_t writeFrame(ostream& output, const EncodedFrame& frame, bool compact = false) {
+    string header;
+    putFrameHeader(header, frame, compact);
+    output.write(header.data(), header.size());
+    for (const string& part : frame.parts) output.write(part.data(), part.size());
+    return header.size() + payloadSize(frame);
+}
+
+// Header: magic (CHECKED_MAGIC when blocks carry checksums), original size
+// (UNKNOWN_SIZE if not known up front), block size, dictionary ID (0 = every frame
+// stores its own code lengths)
+const size_t CONTAINER_HEADER_SIZE = sizeof(CONTAINER_MAGIC) + 8 + 4 + 4;
+
+void putContainerHeader(string& out, uint64_t originalSize, uint32_t blockSize, uint32_t dictionaryId,
+                        bool checksums) {
+    out.append(checksums ? CHECKED_MAGIC : CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+    putUint(out, originalSize, 8);
+    putUint(out, blockSize, 4);
+    putUint(out, dictionaryId, 4);
+}
+
+// Compact header, for an input that fits one block coded with a dictionary: magic
+// (COMPACT_CHECKED_MAGIC with checksums), original size as a varint, dictionary ID.
+// Its one frame follows without a terminator; the block is as large as the input.
+// It saves the full framing's fixed-width fields, about 35 bytes a message.
+void putCompactHeader(string& out, uint64_t originalSize, uint32_t dictionaryId, bool checksums) {
+    out.append(checksums ? COMPACT_CHECKED_MAGIC : COMPACT_MAGIC, sizeof(COMPACT_MAGIC));
+    putVarint(out, originalSize);
+    putUint(out, dictionaryId, 4);
+}
+
+size_t containerHeaderSize(uint64_t originalSize, bool compact) {
+    return compact ? sizeof(COMPACT_MAGIC) + varintSize(originalSize) + 4 : CONTAINER_HEADER_SIZE;
+}
+
+size_t terminatorSize(bool compact) {
+    return compact ? 0 : sizeof(FRAME_TERMINATOR);
+}
+
+// Either header; a compact one reports its input size as the block size
+bool readContainerHeader(istream& input, uint64_t& originalSize, uint32_t& blockSize, uint32_t& dictionaryId,
+                         bool& checksums, bool& compact) {
+    char magic[sizeof(CONTAINER_MAGIC)] = {};
+    input.read(magic, sizeof(magic));
+    auto is = [&](const char* expected) { return equal(magic, magic + sizeof(magic), expected); };
+    compact = is(COMPACT_MAGIC) || is(COMPACT_CHECKED_MAGIC);
+    checksums = is(CHECKED_MAGIC) || is(COMPACT_CHECKED_MAGIC);
+    if (compact) {
+        originalSize = readVarint(input);
+        dictionaryId = uint32_t(readUint(input, 4));
+        blockSize = uint32_t(originalSize);
+        return input && originalSize != 0 && originalSize <= UINT32_MAX && dictionaryId != 0;
+    }
+    if (!checksums && !is(CONTAINER_MAGIC)) return false;
+    originalSize = readUint(input, 8);
+    blockSize = uint32_t(readUint(input, 4));
+    dictionaryId = uint32_t(readUint(input, 4));
+    return input && blockSize != 0;
+}
+
+// FNV-1a over the code lengths: equal tables get equal IDs, never 0
+uint32_t dictionaryIdOf(const CodeLengths& lengths) {
+    uint32_t hash = 2166136261u;
+    for (uint8_t len : lengths) hash = (hash ^ len) * 16777619u;
+    return hash ? hash : 1;
+}
+
+int clampCodeLength(int maxCodeLength) {
+    return max(MIN_CODE_LENGTH_CAP, min(maxCodeLength, MAX_CODE_LENGTH));
+}
+
+// Streaming compression, double-buffered: the next chunk is read and the previous
+// frame written as pool tasks while the current chunk is encoded
+void compressStream(istream& input, ostream& output, uint64_t frameSize, const EncodeSettings& settings,
+                    ThreadPool* pool, StageCounters* counters) {
+    string chunks[2];
+    EncodedFrame frames[2];
+    EncodeScratch scratch;
+    auto readChunk = [&](string& chunk) {
+        StageTimer timer(counters, &StageCounters::read);
+        chunk.resize(frameSize);
+        input.read(&chunk[0], frameSize);
+        chunk.resize(input.gcount());
+        if (counters) counters->bytesIn += chunk.size();
+        if (!chunk.empty()) noteInFlight(counters, 1);
+    };
+
+    // A tied input (cin) flushes its output before every read, racing the write task
+    ostream* tied = input.tie(nullptr);
+    TaskGroup reading, writing;
+    readChunk(chunks[0]);
+    for (int k = 0; !chunks[k % 2].empty(); ++k) {
+        string& chunk = chunks[k % 2];
+        string& next = chunks[(k + 1) % 2];
+        if (input) {
+            runAsync(pool, reading, [&] { readChunk(next); });
+        } else {
+            next.clear();
+        }
+        EncodedFrame* frame = &frames[k % 2];
+        encodeFrame(chunk, settings, pool, *frame, scratch, counters);
+        waitFor(pool, writing);
+        runAsync(pool, writing, [&output, frame, counters] {
+            StageTimer timer(counters, &StageCounters::write);
+            uint64_t bytes = writeFrame(output, *frame);
+            if (counters) counters->bytesOut += bytes;
+            noteInFlight(counters, -1);
+        });
+        waitFor(pool, reading);
+    }
+    waitFor(pool, writing);
+    input.tie(tied);
+}
+
+// Frames kept in flight by the positional I/O pipelines
+const unsigned IO_DEPTH = 4;
+
+#ifdef HAVE_PREAD
+// Streaming compression between regular files: reads of the next IO_DEPTH - 1 chunks
+// and writes of earlier frames are in flight on AsyncIo while a chunk is encoded.
+// Frames are written from `outOffset` on, then the terminator; false on an I/O error.
+bool compressFileStream(AsyncIo& io, int inFd, int outFd, uint64_t outOffset, uint64_t frameSize,
+                        const EncodeSettings& settings, ThreadPool* pool, StageCounters* counters) {
+    struct Slot {
+        string chunk, packed;
+        EncodedFrame frame;
+        IoRequest read, write;
+    };
+    array<Slot, IO_DEPTH> slots;
+    EncodeScratch scratch;
+    uint64_t readOffset = 0;
+    auto startRead = [&](Slot& slot) {
+        slot.chunk.resize(frameSize);
+        slot.read.fd = inFd;
+        slot.read.buffer = &slot.chunk[0];
+        slot.read.length = frameSize;
+        slot.read.offset = readOffset;
+        readOffset += frameSize;
+        io.submit(slot.read);
+    };
+    auto finishWrite = [&](Slot& slot) {
+        StageTimer timer(counters, &StageCounters::write);
+        bool wasPending = !slot.write.done;
+        io.wait(slot.write);
+        if (wasPending) noteInFlight(counters, -1);
+        return slot.write.result == int64_t(slot.write.length);
+    };
+
+    for (Slot& slot : slots) startRead(slot);
+    bool ok = true;
+    for (size_t k = 0; ok; ++k) {
+        Slot& slot = slots[k % IO_DEPTH];
+        {
+            StageTimer timer(counters, &StageCounters::read);
+            io.wait(slot.read);
+        }
+        if (slot.read.result <= 0) {
+            ok = slot.read.result == 0;
+            break;
+        }
+        slot.chunk.resize(size_t(slot.read.result));
+        if (counters) counters->bytesIn += slot.chunk.size();
+        encodeFrame(slot.chunk, settings, pool, slot.frame, scratch, counters);
+        // The chunk is consumed; the slot's previous frame must be out before its buffer is reused
+        bool full = slot.chunk.size() == frameSize;
+        if (full) startRead(slot);
+        ok = finishWrite(slot);
+        slot.packed.clear();
+        putFrameHeader(slot.packed, slot.frame);
+        for (const string& part : slot.frame.parts) slot.packed += part;
+        slot.write.fd = outFd;
+        slot.write.write = true;
+        slot.write.buffer = &slot.packed[0];
+        slot.write.length = slot.packed.size();
+        slot.write.offset = outOffset;
+        outOffset += slot.packed.size();
+        if (counters) counters->bytesOut += slot.packed.size();
+        noteInFlight(counters, 1);
+        io.submit(slot.write);
+        if (!full) break;
+    }
+    for (Slot& slot : slots) {
+        io.wait(slot.read);
+        if (!finishWrite(slot)) ok = false;
+    }
+    ssize_t end = pwrite(outFd, FRAME_TERMINATOR, sizeof(FRAME_TERMINATOR), off_t(outOffset));
+    return ok && end == ssize_t(sizeof(FRAME_TERMINATOR));
+}
+#endif
+
+// What a container header says about decoding its frames
+struct DecodeSettings {
+    uint32_t blockSize;
+    const DecodeTable* presetTable;
+    bool checksums;
+    bool compact;
+    uint64_t maxDecodedSize;
+};
+
+// Largest size a frame or container may claim under `options`
+uint64_t decodeLimit(const HuffmanOptions& options) {
+    return options.maxDecodedSize ? options.maxDecodedSize : UNKNOWN_SIZE;
+}
+
+// A file whose header claims more than the decode limit is refused before any output
+bool withinDecodeLimit(const string& sourceFile, uint64_t originalSize, const DecodeSettings& settings) {
+    if (originalSize == UNKNOWN_SIZE || originalSize <= settings.maxDecodedSize) return true;
+    cerr << "Error: '" << sourceFile << "' claims " << originalSize << " bytes, more than the limit of "
+         << settings.maxDecodedSize << ".\n";
+    return false;
+}
+
+// Decoded bytes of a frame. Unlike a string it leaves new memory untouched, so each
+// page is first written, and on a NUMA host placed, by the worker decoding into it
+// rather than by the thread that sized the frame.
+class OutputBuffer {
+public:
+    void resize(size_t count) {
+        if (count > capacity) {
+            bytes.reset(new char[count]);
+            capacity = count;
+        }
+        length = count;
+    }
+    char* data() { return bytes.get(); }
+    size_t size() const { return length; }
+
+private:
+    unique_ptr<char[]> bytes;
+    size_t length = 0, capacity = 0;
+};
+
+// A frame being decoded. payload views either payloadBuffer or an in-memory source;
+// output points either into outputBuffer or caller memory (mapped file or API buffer),
+// or is null to only check the frame.
+struct DecodedFrame {
+    vector<BlockInfo> blocks;
+    vector<CodeLengths> tables;
+    vector<LzStreams> lzStreams;
+    const DecodeTable* presetTable = nullptr;
+    bool checksums = false;
+    vector<DecodeTable> windowTables; // decode tables of the blocks being decoded, one set per node
+    uint64_t rawSize = 0;
+    string_view payload;
+    string payloadBuffer;
+    uint64_t payloadBytes = 0; // size of all block payloads in the container
+    uint64_t sourceBytes = 0;  // size of the frame in the container
+    char* output = nullptr;
+    OutputBuffer outputBuffer;
+};
+
+// Stream bit counts of a coded block; false on one no code table could produce
+bool readStreamBits(istream& input, BlockInfo& block, bool compact = false) {
+    int streams = streamCountOf(block.rawSize);
+    uint64_t segment = (block.rawSize + streams - 1) / streams;
+    for (int s = 0; s < streams; ++s) {
+        block.streamBits[s] = compact ? readVarint(input) : readUint(input, 8);
+        if (block.streamBits[s] > segment * MAX_CODE_LENGTH) return false;
+        block.payloadBytes += (block.streamBits[s] + 7) / 8;
+    }
+    return true;
+}
+
+// The streams of an LZ block, each a table, raw or rle block of its own
+bool readLzHeader(istream& input, uint32_t rawSize, LzStreams& lz, uint64_t& payloadBytes) {
+    payloadBytes = 0;
+    for (int s = 0; s < LZ_STREAMS; ++s) {
+        uint64_t size = readUint(input, 4);
+        if (size > rawSize + LZ_STREAM_SLACK) return false;
+        BlockInfo& stream = lz.streams[s];
+        stream = BlockInfo{0, uint32_t(size), payloadBytes, 0, {}, BlockMode(input.get()), 0, PRESET_TABLE};
+        if (stream.mode == BLOCK_TABLE) {
+            if (!readCodeLengths(input, lz.lengths[s]) || !readStreamBits(input, stream)) return false;
+        } else if (stream.mode == BLOCK_RAW) {
+            stream.payloadBytes = stream.rawSize;
+        } else if (stream.mode == BLOCK_RLE) {
+            stream.symbol = uint8_t(input.get());
+        } else {
+            return false;
+        }
+        payloadBytes += stream.payloadBytes;
+    }
+    return bool(input);
+}
+
+// Parse one block's mode and its fields into `frame`'s tables; false on a bad mode, a
+// repeat with no table before it, or a bit count no code table could produce
+bool readBlockHeader(istream& input, const DecodeSettings& settings, DecodedFrame& frame, BlockInfo& block) {
+    vector<CodeLengths>& tables = frame.tables;
+    int mode = input.get();
+    block.mode = BlockMode(mode);
+    if (mode == BLOCK_TABLE) {
+        tables.emplace_back();
+        if (!readCodeLengths(input, tables.back())) return false;
+    }
+    if (mode == BLOCK_TABLE || mode == BLOCK_REPEAT) {
+        if (tables.empty() && !settings.presetTable) return false;
+        if (!tables.empty()) block.table = uint32_t(tables.size() - 1);
+        if (!readStreamBits(input, block, settings.compact)) return false;
+    } else if (mode == BLOCK_RAW) {
+        block.payloadBytes = block.rawSize;
+    } else if (mode == BLOCK_RLE) {
+        block.symbol = uint8_t(input.get());
+    } else if (mode == BLOCK_LZ) {
+        block.table = uint32_t(frame.lzStreams.size());
+        frame.lzStreams.emplace_back();
+        if (!readLzHeader(input, block.rawSize, frame.lzStreams.back(), block.payloadBytes)) return false;
+    } else {
+        return false;
+    }
+    if (settings.checksums) block.checksum = uint32_t(readUint(input, 4));
+    return bool(input);
+}
+
+// Bytes left in `input` when it can seek, else UNKNOWN_SIZE
+uint64_t remainingBytes(istream& input) {
+    streampos position = input.tellg();
+    if (position == streampos(-1)) {
+        input.clear();
+        return UNKNOWN_SIZE;
+    }
+    input.seekg(0, ios::end);
+    streampos end = input.tellg();
+    input.seekg(position);
+    return end == streampos(-1) || end < position ? UNKNOWN_SIZE : uint64_t(end - position);
+}
+
+// Read the next frame's size and block headers, leaving `input` at its payload;
+// returns false at the terminator, sets `corrupt` on bad input. A compact container's
+// frame is its one block and has no terminator: the end of input ends it, and callers
+// holding its size catch a missing or extra frame.
+bool readFrameHeader(istream& input, const DecodeSettings& settings, DecodedFrame& frame, bool& corrupt) {
+    uint32_t blockSize = settings.blockSize;
+    if (settings.compact && input.peek() == EOF) return false;
+    uint64_t rawSize = settings.compact ? blockSize : readUint(input, 8);
+    if (!input) {
+        corrupt = true;
+        return false;
+    }
+    if (rawSize == 0) return false;
+    // Every block header takes at least its mode byte and checksum, so a frame cannot
+    // hold more blocks than the rest of a seekable input has bytes for; nor may it claim
+    // more than the decode limit, which bounds what is allocated for it
+    uint64_t blockCount = rawSize / blockSize + (rawSize % blockSize != 0);
+    uint64_t headerBytes = 1 + (settings.checksums ? 4 : 0);
+    if (rawSize > UNKNOWN_SIZE - blockSize || blockCount > remainingBytes(input) / headerBytes ||
+        rawSize > settings.maxDecodedSize) {
+        corrupt = true;
+        return false;
+    }
+
+    frame.rawSize = rawSize;
+    frame.sourceBytes = settings.compact ? 0 : 8;
+    frame.presetTable = settings.presetTable;
+    frame.checksums = settings.checksums;
+    frame.tables.clear();
+    frame.lzStreams.clear();
+    // Blocks are appended as their headers parse, so a corrupt size on a stream fails at
+    // end of input instead of allocating for it
+    frame.blocks.clear();
+    uint64_t byteOffset = 0;
+    for (uint64_t i = 0; i < blockCount; ++i) {
+        BlockInfo block{i * blockSize, uint32_t(min<uint64_t>(blockSize, rawSize - i * blockSize)), byteOffset, 0,
+                        {}, BLOCK_REPEAT, 0, PRESET_TABLE};
+        if (!readBlockHeader(input, settings, frame, block)) {
+            corrupt = true;
+            return false;
+        }
+        frame.blocks.push_back(block);
+        byteOffset += block.payloadBytes;
+        uint64_t bitCounts = 0;
+        for (int s = 0; s < streamCountOf(block.rawSize); ++s)
+            bitCounts += settings.compact ? varintSize(block.streamBits[s]) : 8;
+        uint64_t fields = block.mode == BLOCK_TABLE  ? codeLengthsSize(frame.tables.back()) + bitCounts
+                          : block.mode == BLOCK_REPEAT ? bitCounts
+                          : block.mode == BLOCK_RLE    ? 1
+                          : block.mode == BLOCK_LZ     ? lzHeaderSize(frame.lzStreams.back())
+                                                       : 0;
+        frame.sourceBytes += 1 + fields + (settings.checksums ? 4 : 0);
+    }
+    frame.payloadBytes = byteOffset;
+    frame.sourceBytes += byteOffset;
+    if (frame.blocks.empty() || frame.blocks.back().rawOffset + frame.blocks.back().rawSize != rawSize) {
+        corrupt = true;
+        return false;
+    }
+    return true;
+}
+
+// Move `input` forward by `count` bytes, seeking when it can and reading through otherwise
+bool skipBytes(istream& input, uint64_t count) {
+    if (input.tellg() != streampos(-1)) return bool(input.seekg(streamoff(count), ios::cur));
+    input.clear();
+    input.ignore(streamsize(count));
+    return uint64_t(input.gcount()) == count;
+}
+
+// Take payload bytes [begin, begin + size) of the frame whose header was just read and
+// leave `input` at the next frame. With `source` holding the whole input in memory
+// the payload is referenced in place.
+bool readFramePayload(istream& input, DecodedFrame& frame, bool& corrupt, const string_view* source, uint64_t begin,
+                      uint64_t size) {
+    uint64_t rest = frame.payloadBytes - begin - size;
+    if (source) {
+        uint64_t position = uint64_t(input.tellg());
+        if (position + frame.payloadBytes > source->size()) {
+            corrupt = true;
+            return false;
+        }
+        frame.payload = source->substr(position + begin, size);
+        input.seekg(streamoff(frame.payloadBytes), ios::cur);
+        return true;
+    }
+    frame.payloadBuffer.resize(size);
+    if (!skipBytes(input, begin) || !input.read(&frame.payloadBuffer[0], size) || !skipBytes(input, rest)) {
+        corrupt = true;
+        return false;
+    }
+    frame.payload = frame.payloadBuffer;
+    return true;
+}
+
+// Read the next frame; returns false at the terminator, sets `corrupt` on bad input
+bool readFrame(istream& input, const DecodeSettings& settings, DecodedFrame& frame, bool& corrupt,
+               const string_view* source = nullptr) {
+    return readFrameHeader(input, settings, frame, corrupt) &&
+           readFramePayload(input, frame, corrupt, source, 0, frame.payloadBytes);
+}
+
+// Total size of the frames from the current position of `input`, read from their
+// headers alone, payloads skipped; false when one is damaged. `input` is left where it was.
+bool framedSize(istream& input, const DecodeSettings& settings, uint64_t& total) {
+    streampos start = input.tellg();
+    DecodedFrame frame;
+    bool corrupt = false, valid = true;
+    total = 0;
+    while (valid && readFrameHeader(input, settings, frame, corrupt)) {
+        valid = frame.rawSize <= UNKNOWN_SIZE - total && skipBytes(input, frame.payloadBytes);
+        total += frame.rawSize;
+    }
+    input.clear();
+    input.seekg(start);
+    return valid && !corrupt;
+}
+
+// Decode a frame in windows of a few blocks per worker: the window's tables are
+// built in parallel first, then every block is its own task. Table indices never
+// decrease along a frame, so a window uses a contiguous range of them.
+bool decodeFrame(DecodedFrame& frame, ThreadPool* pool, StageCounters* counters) {
+    atomic<bool> corrupt(false);
+    if (counters) {
+        counters->frames++;
+        counters->blocks += frame.blocks.size();
+    }
+    size_t window = pool ? 4 * size_t(workersOf(pool)) : MIN_FRAME_BLOCKS;
+    for (size_t first = 0; first < frame.blocks.size() && !corrupt; first += window) {
+        size_t count = min(window, frame.blocks.size() - first);
+        uint32_t lowTable = PRESET_TABLE, highTable = 0;
+        for (size_t i = first; i < first + count; ++i) {
+            uint32_t table = frame.blocks[i].table;
+            if (table == PRESET_TABLE || frame.blocks[i].mode >= BLOCK_RAW) continue;
+            lowTable = min(lowTable, table);
+            highTable = max(highTable, table);
+        }
+        size_t tableCount = lowTable == PRESET_TABLE ? 0 : highTable - lowTable + 1;
+        // Each node builds and reads its own copy, instead of every socket reading tables
+        // that are rewritten in one socket's cache each window
+        size_t nodes = pool ? size_t(pool->nodeCount()) : 1;
+        if (frame.windowTables.size() < tableCount * nodes) frame.windowTables.resize(tableCount * nodes);
+        noteQueued(counters, pool, tableCount * nodes);
+        parallelForEachNode(pool, tableCount, [&](size_t t, int node) {
+            StageTimer timer(counters, &StageCounters::table);
+            if (!buildDecodeTable(frame.tables[lowTable + t], frame.windowTables[size_t(node) * tableCount + t]))
+                corrupt = true;
+        });
+        if (corrupt) break;
+
+        noteQueued(counters, pool, count);
+        parallelFor(pool, count, [&](size_t i) {
+            StageTimer timer(counters, &StageCounters::decode);
+            const BlockInfo& block = frame.blocks[first + i];
+            if (corrupt) return;
+            // Checking only: a raw block is its own payload, others decode into per-thread scratch
+            static thread_local string scratch;
+            const char* stored = frame.payload.data() + block.byteOffset;
+            char* out = frame.output ? frame.output + block.rawOffset : nullptr;
+            if (!out && block.mode != BLOCK_RAW) {
+                scratch.resize(block.rawSize);
+                out = &scratch[0];
+            }
+            if (block.mode == BLOCK_RAW) {
+                if (out) memcpy(out, stored, block.rawSize);
+            } else if (block.mode == BLOCK_RLE) {
+                memset(out, block.symbol, block.rawSize);
+            } else if (block.mode == BLOCK_LZ) {
+                if (!decodeLzBlock(frame.lzStreams[block.table], frame.payload, block.byteOffset, out, block.rawSize))
+                    corrupt = true;
+            } else {
+                size_t replica = nodes > 1 ? size_t(pool->currentNode()) * tableCount : 0;
+                const DecodeTable& table = block.table == PRESET_TABLE
+                                               ? *frame.presetTable
+                                               : frame.windowTables[replica + block.table - lowTable];
+                bool decoded = streamCountOf(block.rawSize) == STREAM_COUNT
+                                   ? decodeInterleaved(table, frame.payload, block.byteOffset, block.streamBits, out,
+                                                       block.rawSize)
+                                   : decodeBlock(table, frame.payload, block.byteOffset * 8, block.streamBits[0], out,
+                                                 block.rawSize);
+                if (!decoded) corrupt = true;
+            }
+            // Still in cache from the write above
+            const char* raw = out ? out : stored;
+            if (frame.checksums && !corrupt && crc32c(raw, block.rawSize) != block.checksum) corrupt = true;
+        });
+    }
+    return !corrupt;
+}
+
+// Stream decompression over a ring of three frames: frame k+1 is read and frame k-1
+// written as pool tasks while frame k decodes. With `io` the frames go to `outFd`
+// at their offsets instead, and two writes may be in flight.
+bool decompressStream(istream& input, ostream& output, const DecodeSettings& settings, ThreadPool* pool,
+                      uint64_t& written, StageCounters* counters, AsyncIo* io = nullptr, int outFd = -1) {
+    const int RING = 3;
+    DecodedFrame frames[RING];
+    IoRequest writes[RING];
+    bool present[RING] = {};
+    bool corrupt = false;
+    bool writeFailed = false;
+    auto finishWrite = [&](int slot) {
+        if (writes[slot].done) return;
+        StageTimer timer(counters, &StageCounters::write);
+        io->wait(writes[slot]);
+        if (writes[slot].result != int64_t(writes[slot].length)) writeFailed = true;
+        noteInFlight(counters, -1);
+    };
+    auto readSlot = [&](int slot) {
+        DecodedFrame& frame = frames[slot];
+        StageTimer timer(counters, &StageCounters::read);
+        present[slot] = readFrame(input, settings, frame, corrupt);
+        if (!present[slot]) return;
+        if (counters) counters->bytesIn += frame.sourceBytes;
+        noteInFlight(counters, 1);
+        frame.outputBuffer.resize(frame.rawSize);
+        frame.output = frame.outputBuffer.data();
+    };
+
+    ostream* tied = input.tie(nullptr);
+    TaskGroup reading, writing;
+    bool valid = true;
+    readSlot(0);
+    for (int k = 0; valid && present[k % RING]; ++k) {
+        DecodedFrame* frame = &frames[k % RING];
+        int nextSlot = (k + 1) % RING;
+        // The next slot still holds frame k-2, possibly being written
+        if (io) finishWrite(nextSlot);
+        runAsync(pool, reading, [&, nextSlot] { readSlot(nextSlot); });
+        valid = decodeFrame(*frame, pool, counters);
+        if (valid && io) {
+            IoRequest& request = writes[k % RING];
+            request.fd = outFd;
+            request.write = true;
+            request.buffer = frame->outputBuffer.data();
+            request.length = frame->outputBuffer.size();
+            request.offset = written;
+            written += request.length;
+            io->submit(request);
+        } else if (valid) {
+            waitFor(pool, writing);
+            runAsync(pool, writing, [&output, &written, frame, counters] {
+                StageTimer timer(counters, &StageCounters::write);
+                output.write(frame->outputBuffer.data(), frame->outputBuffer.size());
+                written += frame->outputBuffer.size();
+                noteInFlight(counters, -1);
+            });
+        }
+        waitFor(pool, reading);
+    }
+    waitFor(pool, writing);
+    if (io)
+        for (int slot = 0; slot < RING; ++slot) finishWrite(slot);
+    input.tie(tied);
+    return valid && !corrupt && !writeFailed;
+}
+
+// Zero-copy decompression: frames referenced in the in-memory source, decoded straight into `output`.
+// Without `source` frames are read from `input`; without `output` they are only checked.
+bool decompressInPlace(istream& input, const string_view* source, char* output, uint64_t outputSize,
+                       const DecodeSettings& settings, ThreadPool* pool, DecodedFrame& frame, uint64_t& written,
+                       StageCounters* counters) {
+    bool corrupt = false;
+    auto next = [&] {
+        StageTimer timer(counters, &StageCounters::read);
+        return readFrame(input, settings, frame, corrupt, source);
+    };
+    while (next()) {
+        if (counters) counters->bytesIn += frame.sourceBytes;
+        if (output ? frame.rawSize > outputSize - written : frame.rawSize > UNKNOWN_SIZE - written) return false;
+        frame.output = output ? output + written : nullptr;
+        if (!decodeFrame(frame, pool, counters)) return false;
+        // Checking only, nothing bounds the frame but its blocks: they must make up its size
+        uint64_t decoded = 0;
+        for (const BlockInfo& block : frame.blocks) decoded += block.rawSize;
+        if (decoded != frame.rawSize) return false;
+        written += decoded;
+    }
+    return !corrupt;
+}
+
+// Decode original bytes [offset, offset + length), reading the payload of only the blocks
+// covering them; frames before the range are skipped by their headers. Each frame's part
+// goes to `emit`. `written` is short of `length` when the range runs past the end of the data.
+bool decodeRange(istream& input, const string_view* source, const DecodeSettings& settings, uint64_t offset,
+                 uint64_t length, const function<bool(const char*, uint64_t)>& emit, ThreadPool* pool,
+                 DecodedFrame& frame, uint64_t& written, StageCounters* counters) {
+    bool corrupt = false;
+    uint64_t end = offset + min(length, UNKNOWN_SIZE - offset);
+    uint64_t frameStart = 0;
+    written = 0;
+    if (length == 0) return true;
+    vector<BlockInfo>& blocks = frame.blocks;
+    while (frameStart < end) {
+        uint64_t low, high, rawBase;
+        {
+            StageTimer timer(counters, &StageCounters::read);
+            if (!readFrameHeader(input, settings, frame, corrupt)) break;
+            if (frame.rawSize > UNKNOWN_SIZE - frameStart) return false;
+            uint64_t frameEnd = frameStart + frame.rawSize;
+            if (frameEnd <= offset) {
+                if (!skipBytes(input, frame.payloadBytes)) return false;
+                if (counters) counters->bytesIn += frame.sourceBytes - frame.payloadBytes;
+                frameStart = frameEnd;
+                continue;
+            }
+            // Blocks are blockSize apart in the frame, so the covering ones follow from the range
+            low = max(offset, frameStart) - frameStart;
+            high = min(end, frameEnd) - frameStart;
+            uint64_t firstBlock = low / settings.blockSize, lastBlock = (high - 1) / settings.blockSize;
+            if (lastBlock >= blocks.size() || blocks[firstBlock].rawOffset > low ||
+                blocks[lastBlock].rawOffset + blocks[lastBlock].rawSize < high)
+                return false;
+            blocks.erase(blocks.begin() + ptrdiff_t(lastBlock + 1), blocks.end());
+            blocks.erase(blocks.begin(), blocks.begin() + ptrdiff_t(firstBlock));
+            rawBase = blocks.front().rawOffset;
+            uint64_t byteBase = blocks.front().byteOffset;
+            uint64_t bytes = blocks.back().byteOffset + blocks.back().payloadBytes - byteBase;
+            for (BlockInfo& block : blocks) {
+                block.rawOffset -= rawBase;
+                block.byteOffset -= byteBase;
+            }
+            if (!readFramePayload(input, frame, corrupt, source, byteBase, bytes)) return false;
+            if (counters) counters->bytesIn += frame.sourceBytes - frame.payloadBytes + bytes;
+            frameStart = frameEnd;
+        }
+        frame.outputBuffer.resize(blocks.back().rawOffset + blocks.back().rawSize);
+        frame.output = frame.outputBuffer.data();
+        if (!decodeFrame(frame, pool, counters)) return false;
+        if (!emit(frame.output + (low - rawBase), high - low)) return false;
+        written += high - low;
+    }
+    return !corrupt;
+}
+
+// Pre-block format of the first releases: the tree in pre-order ('0' internal, '1' and
+// the raw byte for a leaf), a newline, then one ASCII '0'/'1' per code bit. Nothing
+// records where codewords fall, so segments are decoded speculatively and stitched.
+const char LEGACY_SEPARATOR = '\n';
+// Bits per speculative segment at least; shorter streams are not worth splitting
+const size_t LEGACY_MIN_SEGMENT = 1 << 16;
+
+// Legacy tree as internal nodes: a child >= 0 is another internal node, < 0 is ~symbol.
+// Node 0 is the root; a stream whose tree is a single leaf has no internal nodes.
+struct LegacyTree {
+    vector<array<int16_t, 2>> nodes;
+    uint8_t onlySymbol = 0;
+};
+
+// Parse the pre-order tree at the start of `file`; `pos` ends past the separator
+bool parseLegacyTree(string_view file, LegacyTree& tree, size_t& pos) {
+    pos = 0;
+    if (file.size() >= 2 && file[0] == '1') {
+        tree.onlySymbol = uint8_t(file[1]);
+        pos = 2;
+        return file.size() > pos && file[pos++] == LEGACY_SEPARATOR;
+    }
+    // Open internal nodes and which of their children comes next
+    vector<pair<int16_t, int>> open;
+    int leaves = 0;
+    do {
+        if (pos >= file.size()) return false;
+        int16_t child;
+        if (file[pos] == '0') {
+            if (tree.nodes.size() >= 255) return false;
+            child = int16_t(tree.nodes.size());
+            tree.nodes.push_back({0, 0});
+            ++pos;
+        } else if (file[pos] == '1' && pos + 1 < file.size() && leaves < 256) {
+            child = int16_t(~int16_t(uint8_t(file[pos + 1])));
+            ++leaves;
+            pos += 2;
+        } else {
+            return false;
+        }
+        if (!open.empty()) {
+            tree.nodes[open.back().first][open.back().second] = child;
+            if (++open.back().second == 2) open.pop_back();
+        }
+        if (child >= 0) open.push_back({child, 0});
+    } while (!open.empty());
+    return file.size() > pos && file[pos++] == LEGACY_SEPARATOR;
+}
+
+// One worker's speculative decode of bits [begin, end): it assumes a codeword starts at
+// `begin`, marks every codeword start it meets and finishes the codeword crossing `end`
+struct LegacySegment {
+    size_t begin = 0, end = 0, exit = 0;
+    vector<uint64_t> starts;
+    string symbols;
+    bool complete = true;
+
+    bool startsAt(size_t bit) const {
+        size_t k = bit - begin;
+        return bit >= begin && bit < end && (starts[k >> 6] >> (k & 63) & 1);
+    }
+
+    // Symbols decoded before the codeword starting at `bit`
+    size_t rankOf(size_t bit) const {
+        size_t k = bit - begin, rank = 0;
+        for (size_t w = 0; w < (k >> 6); ++w) rank += __builtin_popcountll(starts[w]);
+        return rank + __builtin_popcountll(starts[k >> 6] & ((uint64_t(1) << (k & 63)) - 1));
+    }
+};
+
+// Decode from codeword start `pos` on, stopping at the first codeword start that is
+// >= `stop` or satisfies `synced`; false on a byte that is not a bit
+template <typename Synced>
+bool walkLegacy(const LegacyTree& tree, string_view bits, size_t& pos, size_t stop, const Synced& synced,
+                string& out, bool& complete) {
+    int node = 0;
+    complete = true;
+    while (pos < bits.size()) {
+        if (node == 0 && (pos >= stop || synced(pos))) return true;
+        unsigned bit = unsigned(bits[pos]) - '0';
+        if (bit > 1) return false;
+        int child = tree.nodes[node][bit];
+        ++pos;
+        if (child < 0) {
+            out.push_back(char(~child));
+            node = 0;
+        } else {
+            node = child;
+        }
+    }
+    complete = node == 0;
+    return true;
+}
+
+// Speculative parallel decode of a legacy file. Each worker decodes its range from the
+// range's first bit. A prefix code resynchronizes within a few codewords, so when the
+// true decoding from the previous range's exit reaches a codeword start the worker also
+// saw, the rest of the worker's output is correct; only that short prefix is redone.
+bool decodeLegacy(string_view file, ThreadPool* pool, string& output, size_t& resynced) {
+    LegacyTree tree;
+    size_t pos;
+    resynced = 0;
+    if (!parseLegacyTree(file, tree, pos)) return false;
+    string_view bits = file.substr(pos);
+    output.clear();
+    // A one-leaf tree coded every byte as the empty string, so the length is lost
+    if (tree.nodes.empty()) return false;
+
+    size_t segmentCount = pool ? 4 * size_t(workersOf(pool)) : 1;
+    segmentCount = max<size_t>(1, min(segmentCount, bits.size() / LEGACY_MIN_SEGMENT));
+    vector<LegacySegment> segments(segmentCount);
+    atomic<bool> corrupt(false);
+    parallelFor(pool, segmentCount, [&](size_t i) {
+        LegacySegment& segment = segments[i];
+        segment.begin = bits.size() * i / segmentCount;
+        segment.end = bits.size() * (i + 1) / segmentCount;
+        segment.starts.assign((segment.end - segment.begin + 63) / 64 + 1, 0);
+        segment.exit = segment.begin;
+        auto mark = [&segment](size_t bit) {
+            size_t k = bit - segment.begin;
+            segment.starts[k >> 6] |= uint64_t(1) << (k & 63);
+            return false;
+        };
+        if (!walkLegacy(tree, bits, segment.exit, segment.end, mark, segment.symbols, segment.complete))
+            corrupt = true;
+    });
+    if (corrupt) return false;
+
+    size_t exit = 0;
+    for (LegacySegment& segment : segments) {
+        if (exit >= segment.end) continue;
+        size_t sync = exit;
+        bool complete;
+        auto synced = [&segment](size_t bit) { return segment.startsAt(bit); };
+        if (!walkLegacy(tree, bits, sync, segment.end, synced, output, complete) || !complete) return false;
+        if (sync < segment.end) {
+            // In step: adopt the speculative output from the shared codeword on
+            if (sync != exit) ++resynced;
+            output.append(segment.symbols, segment.rankOf(sync), string::npos);
+            if (!segment.complete) return false;
+            exit = segment.exit;
+        } else {
+            ++resynced;
+            exit = sync;
+        }
+        segment.symbols = string();
+    }
+    return exit == bits.size();
+}
+
+// One call's counters, copied into options.stats (if set) when the call returns
+class CallStats {
+public:
+    CallStats(const HuffmanOptions& options, ThreadPool* pool, const string& source = string())
+        : target(options.stats), pool(pool), source(source), start(steady_clock::now()) {
+        if (target && pool)
+            for (int w = 0; w < pool->size(); ++w) busyBefore.push_back(pool->busyNanos(w));
+    }
+
+    ~CallStats() {
+        if (!target) return;
+        HuffmanStats& out = *target;
+        out = HuffmanStats();
+        out.source = source;
+        out.bytesIn = stage.bytesIn;
+        out.bytesOut = stage.bytesOut;
+        out.frames = stage.frames;
+        out.blocks = stage.blocks;
+        out.histogramNanos = stage.histogram;
+        out.tableNanos = stage.table;
+        out.encodeNanos = stage.encode;
+        out.decodeNanos = stage.decode;
+        out.readNanos = stage.read;
+        out.writeNanos = stage.write;
+        out.wallNanos = uint64_t(duration_cast<nanoseconds>(steady_clock::now() - start).count());
+        for (size_t w = 0; w < busyBefore.size(); ++w)
+            out.workerBusyNanos.push_back(pool->busyNanos(int(w)) - busyBefore[w]);
+        out.peakQueuedTasks = stage.peakQueued;
+        out.peakFramesInFlight = stage.peakInFlight;
+    }
+
+    CallStats(const CallStats&) = delete;
+    CallStats& operator=(const CallStats&) = delete;
+
+    StageCounters* counters() { return target ? &stage : nullptr; }
+
+private:
+    HuffmanStats* target;
+    ThreadPool* pool;
+    string source;
+    steady_clock::time_point start;
+    vector<uint64_t> busyBefore;
+    StageCounters stage;
+};
+
+// A compressed file as an istream: mapped when possible, else read through, else stdin
+struct CompressedInput {
+    MappedFile mapped;
+    ifstream file;
+    unique_ptr<MemoryStreamBuf> memoryBuffer;
+    unique_ptr<istream> memory;
+    istream* stream = &cin;
+
+    bool open(const string& name) {
+        if (name == STDIO_NAME) return true;
+        if (mapped.openRead(name)) {
+            memoryBuffer = make_unique<MemoryStreamBuf>(mapped.data(), mapped.size());
+            memory = make_unique<istream>(memoryBuffer.get());
+            stream = memory.get();
+            return true;
+        }
+        file.open(name, ios::binary);
+        stream = &file;
+        return bool(file);
+    }
+
+    // The whole input, for formats without frames; `buffer` holds it unless mapped
+    string_view readAll(string& buffer) {
+        if (mapped.isOpen()) return mapped.view();
+        buffer.assign(istreambuf_iterator<char>(*stream), istreambuf_iterator<char>());
+        return buffer;
+    }
+};
+
+// Files from before the block container begin with the tree instead of the magic
+bool isLegacy(istream& input) {
+    int first = input.peek();
+    return first == '0' || first == '1';
+}
+
+// A legacy tree with one leaf gives no bit per symbol, so the length is lost
+bool isSingleSymbolLegacy(string_view legacy) {
+    return legacy.size() == 3 && legacy[0] == '1' && legacy[2] == LEGACY_SEPARATOR;
+}
+
+// The caller's pool if given, else a private one when more than one thread is asked for
+ThreadPool* resolvePool(const HuffmanOptions& options, unique_ptr<ThreadPool>& owned) {
+    if (options.pool) return options.pool;
+    if (options.threadCount > 1) owned = make_unique<ThreadPool>(options.threadCount, options.pinThreads);
+    return owned.get();
+}
+
+// Workers one call keeps busy on `pool`: with the caller's pool, threadCount of them when
+// above 1 (a tuned count), else all of its workers
+int callWorkers(const HuffmanOptions& options, ThreadPool* pool) {
+    if (!pool) return 1;
+    return options.threadCount > 1 ? min(options.threadCount, pool->size()) : pool->size();
+}
+
+// Single-thread rates assumed when nothing was measured, on the low side so that a
+// guess errs toward fewer threads
+const double TUNE_ORDER0_RATE = 200e6, TUNE_LZ_RATE = 100e6, TUNE_DECODE_RATE = 200e6;
+// Each extra thread must get at least this much work to pay for waking it and for the
+// tables of its blocks
+const double TUNE_SECONDS_PER_THREAD = 0.002;
+const size_t TUNE_SAMPLE_SIZE = 256 * 1024;
+const uint32_t TUNE_MIN_BLOCK_SIZE = 64 * 1024;
+
+int availableThreads(const HuffmanOptions& options) {
+    return options.pool ? callWorkers(options, options.pool) : max(1, int(thread::hardware_concurrency()));
+}
+
+// Threads worth using for `size` bytes at `rate` bytes per second on one thread
+int tunedThreadCount(uint64_t size, double rate, int available) {
+    if (size == UNKNOWN_SIZE) return available;
+    return int(clamp(double(size) / rate / TUNE_SECONDS_PER_THREAD, 1.0, double(available)));
+}
+
+// `options` resolved to run on `threads` threads: the caller's pool, a private one, or inline
+HuffmanOptions withThreads(const HuffmanOptions& options, int threads) {
+    HuffmanOptions tuned = options;
+    tuned.autoTune = false;
+    tuned.threadCount = threads;
+    if (threads == 1) tuned.pool = nullptr;
+    return tuned;
+}
+
+// Decoding has no sample to time; its rate barely depends on the data
+HuffmanOptions tunedForDecode(const HuffmanOptions& options, uint64_t size) {
+    if (!options.autoTune) return options;
+    return withThreads(options, tunedThreadCount(size, TUNE_DECODE_RATE, availableThreads(options)));
+}
+
+// Pool for one in-memory call and the workers it may use: none when autoTune finds
+// `size` bytes too few to split, otherwise at most as many as they are worth
+ThreadPool* poolForCall(const HuffmanOptions& options, ThreadPool* pool, uint64_t size, double rate, int& workers) {
+    workers = callWorkers(options, pool);
+    if (!options.autoTune || !pool) return pool;
+    workers = tunedThreadCount(size, rate, workers);
+    return workers > 1 ? pool : nullptr;
+}
+
+// Size of a file, or UNKNOWN_SIZE for stdin and anything without one
+uint64_t fileSizeOf(const string& path) {
+    error_code error;
+    uint64_t size = path == STDIO_NAME ? UNKNOWN_SIZE : uint64_t(filesystem::file_size(path, error));
+    return error ? UNKNOWN_SIZE : size;
+}
+
+// The first TUNE_SAMPLE_SIZE bytes of a file, empty for stdin
+string readSample(const string& path) {
+    string sample;
+    if (path == STDIO_NAME) return sample;
+    ifstream file(path, ios::binary);
+    sample.resize(TUNE_SAMPLE_SIZE);
+    file.read(&sample[0], streamsize(sample.size()));
+    sample.resize(size_t(file.gcount()));
+    return sample;
+}
+
+} // namespace
+
+struct HuffmanDictionary::State {
+    Histogram samples{};
+    bool ready = false;
+    uint32_t id = 0;
+    PresetTable table;
+
+    // Derive the encode/decode tables; every byte needs a code or inputs could be unencodable
+    bool install(const CodeLengths& codeLengths) {
+        for (uint8_t len : codeLengths)
+            if (!len) return false;
+        if (!buildDecodeTable(codeLengths, table.decode)) return false;
+        table.lengths = codeLengths;
+        assignCanonicalCodes(table.lengths, table.codes);
+        id = dictionaryIdOf(table.lengths);
+        ready = true;
+        return true;
+    }
+};
+
+namespace {
+
+const HuffmanDictionary::State* readyDictionary(const HuffmanOptions& options) {
+    return options.dictionary && options.dictionary->isReady() ? options.dictionary->tables() : nullptr;
+}
+
+// The dictionary a container was written with, checked against the caller's
+bool matchDictionary(uint32_t dictionaryId, const HuffmanOptions& options, const DecodeTable*& presetTable) {
+    presetTable = nullptr;
+    if (dictionaryId == 0) return true;
+    const HuffmanDictionary::State* dictionary = readyDictionary(options);
+    if (!dictionary || dictionary->id != dictionaryId) return false;
+    presetTable = &dictionary->table.decode;
+    return true;
+}
+
+// Quote a string for JSON, which may not hold a raw control character
+string quoted(const string& text) {
+    string out = "\"";
+    for (char ch : text) {
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if (ch == '\n') {
+            out += "\\n";
+        } else if (ch == '\t') {
+            out += "\\t";
+        } else if (ch == '\r') {
+            out += "\\r";
+        } else if ((unsigned char)ch < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)ch);
+            out += escape;
+        } else {
+            out += ch;
+        }
+    }
+    return out + '"';
+}
+
+// Quote a Prometheus label value; the text format escapes only these three and
+// takes any other character as it is
+string labelValue(const string& text) {
+    string out = "\"";
+    for (char ch : text) {
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if (ch == '\n') {
+            out += "\\n";
+        } else {
+            out += ch;
+        }
+    }
+    return out + '"';
+}
+
+string secondsText(uint64_t nanos) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.9f", nanos / 1e9);
+    return text;
+}
+
+} // namespace
+
+HuffmanDictionary::HuffmanDictionary() : state(make_unique<State>()) {}
+
+HuffmanDictionary::~HuffmanDictionary() = default;
+
+void HuffmanDictionary::addSample(span<const uint8_t> sample) {
+    countHistogramRange(string_view((const char*)sample.data(), sample.size()), 0, sample.size(), state->samples);
+}
+
+// Every byte value counts once more than sampled so unseen bytes still get a (long) code
+bool HuffmanDictionary::train(int maxCodeLength) {
+    Histogram smoothed = state->samples;
+    for (uint64_t& count : smoothed) count = count * 2 + 1;
+    CodeLengths lengths;
+    buildCodeLengths(smoothed, lengths, clampCodeLength(maxCodeLength));
+    return state->install(lengths);
+}
+
+bool HuffmanDictionary::isReady() const {
+    return state->ready;
+}
+
+uint32_t HuffmanDictionary::id() const {
+    return state->ready ? state->id : 0;
+}
+
+const HuffmanDictionary::State* HuffmanDictionary::tables() const {
+    return state.get();
+}
+
+// Magic, ID, then the code lengths in the frame header encoding
+string HuffmanDictionary::serialize() const {
+    string out;
+    if (!state->ready) return out;
+    out.append(DICTIONARY_MAGIC, sizeof(DICTIONARY_MAGIC));
+    putUint(out, state->id, 4);
+    putCodeLengths(out, state->table.lengths);
+    return out;
+}
+
+bool HuffmanDictionary::load(span<const uint8_t> serialized) {
+    MemoryStreamBuf buffer((const char*)serialized.data(), serialized.size());
+    istream input(&buffer);
+    char magic[sizeof(DICTIONARY_MAGIC)] = {};
+    input.read(magic, sizeof(magic));
+    if (!equal(magic, magic + sizeof(magic), DICTIONARY_MAGIC)) return false;
+    uint32_t storedId = uint32_t(readUint(input, 4));
+    CodeLengths lengths;
+    if (!input || !readCodeLengths(input, lengths) || dictionaryIdOf(lengths) != storedId) return false;
+    return state->install(lengths);
+}
+
+bool saveDictionaryFile(const string& path, const HuffmanDictionary& dictionary) {
+    string serialized = dictionary.serialize();
+    if (serialized.empty()) return false;
+    ofstream output(path, ios::binary);
+    output.write(serialized.data(), serialized.size());
+    return bool(output.flush());
+}
+
+bool loadDictionaryFile(const string& path, HuffmanDictionary& dictionary) {
+    ifstream input(path, ios::binary);
+    if (!input) return false;
+    string serialized((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+    return dictionary.load(span<const uint8_t>((const uint8_t*)serialized.data(), serialized.size()));
+}
+
+void countByteFrequencies(span<const uint8_t> data, ThreadPool* pool, array<uint64_t, 256>& counts) {
+    counts.fill(0);
+    countFrequencies(string_view((const char*)data.data(), data.size()), pool, counts);
+}
+
+void selectKernels(HuffmanKernels kernels) {
+    portableKernels = kernels == HuffmanKernels::Portable;
+}
+
+const char* kernelName() {
+    return hasBmi2() ? "bmi2" : "portable";
+}
+
+void computeCodeLengths(const array<uint64_t, 256>& counts, int maxCodeLength, array<uint8_t, 256>& lengths) {
+    buildCodeLengths(counts, lengths, clampCodeLength(maxCodeLength));
+}
+
+string formatStatsJson(const HuffmanStats& stats) {
+    string out = "{\"source\":" + quoted(stats.source);
+    auto field = [&out](const char* name, uint64_t value) {
+        out += ",\"";
+        out += name;
+        out += "\":" + to_string(value);
+    };
+    field("bytes_in", stats.bytesIn);
+    field("bytes_out", stats.bytesOut);
+    field("frames", stats.frames);
+    field("blocks", stats.blocks);
+    field("histogram_ns", stats.histogramNanos);
+    field("table_ns", stats.tableNanos);
+    field("encode_ns", stats.encodeNanos);
+    field("decode_ns", stats.decodeNanos);
+    field("read_ns", stats.readNanos);
+    field("write_ns", stats.writeNanos);
+    field("wall_ns", stats.wallNanos);
+    field("peak_queued_tasks", stats.peakQueuedTasks);
+    field("peak_frames_in_flight", stats.peakFramesInFlight);
+    out += ",\"workers\":[";
+    for (size_t w = 0; w < stats.workerBusyNanos.size(); ++w) {
+        uint64_t busy = stats.workerBusyNanos[w];
+        out += w ? ",{" : "{";
+        out += "\"busy_ns\":" + to_string(busy) +
+               ",\"idle_ns\":" + to_string(stats.wallNanos > busy ? stats.wallNanos - busy : 0) + "}";
+    }
+    return out + "]}";
+}
+
+// Gauges, since each sample describes one finished call
+string formatStatsPrometheus(span<const HuffmanStats> stats) {
+    string out;
+    auto family = [&](const char* name, const char* help, const auto& samples) {
+        out += string("# HELP huffman_") + name + " " + help + "\n";
+        out += string("# TYPE huffman_") + name + " gauge\n";
+        for (const HuffmanStats& call : stats) {
+            auto sample = [&](const string& labels, const string& value) {
+                out += string("huffman_") + name + "{source=" + labelValue(call.source) + labels + "} " + value + "\n";
+            };
+            samples(call, sample);
+        }
+    };
+    auto count = [&](const char* name, const char* help, uint64_t HuffmanStats::*member) {
+        family(name, help, [member](const HuffmanStats& call, const auto& sample) { sample("", to_string(call.*member)); });
+    };
+    count("input_bytes", "Bytes read by the call.", &HuffmanStats::bytesIn);
+    count("output_bytes", "Bytes written by the call.", &HuffmanStats::bytesOut);
+    count("frames", "Frames coded.", &HuffmanStats::frames);
+    count("blocks", "Blocks coded.", &HuffmanStats::blocks);
+    family("stage_seconds", "Time in each stage, summed over tasks.", [](const HuffmanStats& call, const auto& sample) {
+        sample(",stage=\"histogram\"", secondsText(call.histogramNanos));
+        sample(",stage=\"table\"", secondsText(call.tableNanos));
+        sample(",stage=\"encode\"", secondsText(call.encodeNanos));
+        sample(",stage=\"decode\"", secondsText(call.decodeNanos));
+        sample(",stage=\"read\"", secondsText(call.readNanos));
+        sample(",stage=\"write\"", secondsText(call.writeNanos));
+    });
+    family("wall_seconds", "Elapsed time of the call.",
+           [](const HuffmanStats& call, const auto& sample) { sample("", secondsText(call.wallNanos)); });
+    family("worker_busy_seconds", "Time each pool worker ran tasks during the call.",
+           [](const HuffmanStats& call, const auto& sample) {
+               for (size_t w = 0; w < call.workerBusyNanos.size(); ++w)
+                   sample(",worker=\"" + to_string(w) + "\"", secondsText(call.workerBusyNanos[w]));
+           });
+    family("worker_idle_seconds", "Time each pool worker had no task during the call.",
+           [](const HuffmanStats& call, const auto& sample) {
+               for (size_t w = 0; w < call.workerBusyNanos.size(); ++w) {
+                   uint64_t busy = call.workerBusyNanos[w];
+                   sample(",worker=\"" + to_string(w) + "\"", secondsText(call.wallNanos > busy ? call.wallNanos - busy : 0));
+               }
+           });
+    count("peak_queued_tasks", "Most pool tasks waiting at once.", &HuffmanStats::peakQueuedTasks);
+    count("peak_frames_in_flight", "Most frames held by the streaming pipeline at once.",
+          &HuffmanStats::peakFramesInFlight);
+    return out;
+}
+
+HuffmanOptions tuneOptions(const HuffmanOptions& options, uint64_t inputSize, span<const uint8_t> sample) {
+    bool lz = options.engine == HuffmanEngine::Lz77 && !readyDictionary(options);
+    double rate = lz ? TUNE_LZ_RATE : TUNE_ORDER0_RATE;
+    // Too small a sample times mostly the table build; it would understate the rate
+    if (sample.size() >= TUNE_SAMPLE_SIZE / 4) {
+        const HuffmanDictionary::State* dictionary = readyDictionary(options);
+        EncodeSettings settings{DEFAULT_BLOCK_SIZE, clampCodeLength(options.maxCodeLength),
+                                dictionary ? &dictionary->table : nullptr, options.checksums, lz};
+        EncodedFrame frame;
+        EncodeScratch scratch;
+        auto start = steady_clock::now();
+        encodeFrame(string_view((const char*)sample.data(), sample.size()), settings, nullptr, frame, scratch, nullptr);
+        double seconds = duration<double>(steady_clock::now() - start).count();
+        if (seconds > 0) rate = double(sample.size()) / seconds;
+    }
+    int threads = tunedThreadCount(inputSize, rate, availableThreads(options));
+    HuffmanOptions tuned = withThreads(options, threads);
+    // Two blocks per thread lets stealing even out the blocks that code slower; one
+    // thread keeps the default, since more blocks only add tables
+    if (options.blockSize == 0) {
+        uint64_t perBlock = inputSize == UNKNOWN_SIZE || threads == 1 ? DEFAULT_BLOCK_SIZE
+                                                                      : inputSize / (2 * uint64_t(threads));
+        tuned.blockSize = uint32_t(clamp<uint64_t>(bit_floor(max<uint64_t>(perBlock, 1)), TUNE_MIN_BLOCK_SIZE,
+                                                   DEFAULT_BLOCK_SIZE));
+    }
+    return tuned;
+}
+
+bool compressDataFile(const string& sourceFile, const string& targetFile, const HuffmanOptions& requested,
+                      bool streaming, bool verbose) {
+    HuffmanOptions options = requested;
+    if (requested.autoTune) {
+        string sample = readSample(sourceFile);
+        options = tuneOptions(requested, fileSizeOf(sourceFile),
+                              span<const uint8_t>((const uint8_t*)sample.data(), sample.size()));
+        if (verbose)
+            cerr << "Auto-tuned to " << options.threadCount << " threads, "
+                 << options.blockSize / 1024 << " KiB blocks.\n";
+    }
+    unique_ptr<ThreadPool> ownedPool;
+    ThreadPool* pool = resolvePool(options, ownedPool);
+    int threadCount = callWorkers(options, pool);
+    WorkerLimit limit(threadCount);
+    uint32_t blockSize = options.blockSize ? options.blockSize : DEFAULT_BLOCK_SIZE;
+    const HuffmanDictionary::State* dictionary = readyDictionary(options);
+    EncodeSettings settings{blockSize, clampCodeLength(options.maxCodeLength), dictionary ? &dictionary->table : nullptr,
+                            options.checksums, options.engine == HuffmanEngine::Lz77};
+    CallStats stats(options, pool, sourceFile);
+    StageCounters* counters = stats.counters();
+
+    // stdin has no size up front, so it is always streamed
+    ifstream fileInput;
+    istream* input = &cin;
+    uint64_t originalSize = UNKNOWN_SIZE;
+    if (sourceFile == STDIO_NAME) {
+        streaming = true;
+    } else {
+        fileInput.open(sourceFile, ios::binary | ios::ate);
+        if (!fileInput) {
+            cerr << "Error: Cannot open input file '" << sourceFile << "'.\n";
+            return false;
+        }
+        originalSize = fileInput.tellg();
+        fileInput.seekg(0);
+        input = &fileInput;
+    }
+
+    ofstream fileOutput;
+    ostream* output = &cout;
+    if (targetFile != STDIO_NAME) {
+        fileOutput.open(targetFile, ios::binary);
+        if (!fileOutput) {
+            cerr << "Error: Cannot create output file '" << targetFile << "'.\n";
+            return false;
+        }
+        output = &fileOutput;
+    }
+    // A file that fits one dictionary-coded block goes in a compact container
+    bool compact = dictionary && !streaming && originalSize != 0 && originalSize <= blockSize;
+    string header;
+    if (compact) putCompactHeader(header, originalSize, dictionary->id, settings.checksums);
+    if (!compact)
+        putContainerHeader(header, originalSize, blockSize, dictionary ? dictionary->id : 0, settings.checksums);
+    output->write(header.data(), header.size());
+    if (counters) counters->bytesOut += header.size() + terminatorSize(compact);
+
+    if (streaming) {
+        auto start = high_resolution_clock::now();
+        // Two blocks per worker keeps every thread busy while bounding each frame
+        uint64_t frameBlocks = max<uint64_t>(MIN_FRAME_BLOCKS, 2 * uint64_t(threadCount));
+        uint64_t frameSize = uint64_t(blockSize) * frameBlocks;
+        AsyncIo io(pool, 2 * IO_DEPTH);
+        bool ok = false;
+        int inFd = -1, outFd = -1;
+#ifdef HAVE_PREAD
+        // Between regular files, frames are read ahead and written behind with positional I/O
+        if (sourceFile != STDIO_NAME && targetFile != STDIO_NAME && fileOutput.flush()) {
+            inFd = openRegular(sourceFile, O_RDONLY);
+            outFd = inFd >= 0 ? openRegular(targetFile, O_WRONLY) : -1;
+        }
+        if (outFd >= 0) {
+            fileOutput.close();
+            ok = compressFileStream(io, inFd, outFd, header.size(), frameSize, settings, pool, counters);
+            ok = ::close(outFd) == 0 && ok;
+        }
+        if (inFd >= 0) ::close(inFd);
+#endif
+        if (outFd < 0) {
+            compressStream(*input, *output, frameSize, settings, pool, counters);
+            output->write(FRAME_TERMINATOR, sizeof(FRAME_TERMINATOR));
+            output->flush();
+            ok = *output && !input->bad();
+        }
+        auto end = high_resolution_clock::now();
+        if (!ok) {
+            cerr << "Error: I/O failure while compressing '" << sourceFile << "'.\n";
+            return false;
+        }
+        if (verbose) {
+            const char* backend = outFd < 0 ? "streams" : io.usesUring() ? "io_uring" : "thread";
+            cerr << "\n--- Compression Performance ---\n";
+            cerr << "Streaming time (" << backend << " I/O): " << duration_cast<nanoseconds>(end - start).count() / 1e6
+                 << " ms\n";
+            cerr << "Compression completed. Output saved to '" << targetFile << "'.\n";
+        }
+        return true;
+    }
+
+    // Map the input when possible so histogram and encode workers read the page cache directly
+    MappedFile mappedInput;
+    string fileData;
+    string_view data;
+    {
+        StageTimer timer(counters, &StageCounters::read);
+        if (mappedInput.openRead(sourceFile)) {
+            data = mappedInput.view();
+        } else {
+            fileData.assign(istreambuf_iterator<char>(*input), istreambuf_iterator<char>());
+            data = fileData;
+        }
+        fileInput.close();
+    }
+    if (counters) counters->bytesIn += data.size();
+
+    // Whole file as a single frame
+    EncodedFrame frame;
+    if (!data.empty()) {
+        EncodeScratch scratch;
+        auto start = high_resolution_clock::now();
+        encodeFrame(data, settings, pool, frame, scratch, counters);
+        auto end = high_resolution_clock::now();
+        StageTimer timer(counters, &StageCounters::write);
+        uint64_t bytes = writeFrame(*output, frame, compact);
+        if (counters) counters->bytesOut += bytes;
+        if (verbose) {
+            cerr << "\n--- Compression Performance ---\n";
+            cerr << "Encode time (" << threadCount << " threads): "
+                 << duration_cast<nanoseconds>(end - start).count() / 1e6 << " ms\n";
+        }
+    }
+    output->write(FRAME_TERMINATOR, terminatorSize(compact));
+    output->flush();
+    if (!*output) {
+        cerr << "Error: Cannot write output file '" << targetFile << "'.\n";
+        return false;
+    }
+
+    if (verbose) cerr << "Compression completed. Output saved to '" << targetFile << "'.\n";
+    return true;
+}
+
+bool decompressDataFile(const string& sourceFile, const string& targetFile, const HuffmanOptions& requested,
+                        bool verbose) {
+    HuffmanOptions options = tunedForDecode(requested, fileSizeOf(sourceFile));
+    unique_ptr<ThreadPool> ownedPool;
+    ThreadPool* pool = resolvePool(options, ownedPool);
+    int threadCount = callWorkers(options, pool);
+    WorkerLimit limit(threadCount);
+    CallStats stats(options, pool, sourceFile);
+    StageCounters* counters = stats.counters();
+    CompressedInput source;
+    if (!source.open(sourceFile)) {
+        cerr << "Error: Cannot open compressed file '" << sourceFile << "'.\n";
+        return false;
+    }
+    MappedFile& mappedInput = source.mapped;
+    istream* input = source.stream;
+
+    if (isLegacy(*input)) {
+        string legacyInput;
+        string_view legacy;
+        {
+            StageTimer timer(counters, &StageCounters::read);
+            legacy = source.readAll(legacyInput);
+        }
+        string decoded;
+        size_t resynced;
+        auto start = high_resolution_clock::now();
+        bool valid;
+        {
+            StageTimer timer(counters, &StageCounters::decode);
+            valid = decodeLegacy(legacy, pool, decoded, resynced);
+        }
+        if (!valid) {
+            if (isSingleSymbolLegacy(legacy))
+                cerr << "Error: '" << sourceFile << "' is a single-symbol legacy file, which does not record its length.\n";
+            else
+                cerr << "Error: Corrupt compressed data in '" << sourceFile << "'.\n";
+            return false;
+        }
+        auto end = high_resolution_clock::now();
+        if (counters) {
+            counters->frames++;
+            counters->bytesIn += legacy.size();
+            counters->bytesOut += decoded.size();
+        }
+        StageTimer timer(counters, &StageCounters::write);
+        ofstream fileOutput;
+        if (targetFile != STDIO_NAME) fileOutput.open(targetFile, ios::binary);
+        ostream& output = targetFile == STDIO_NAME ? cout : fileOutput;
+        if (!output || !output.write(decoded.data(), decoded.size()) || !output.flush()) {
+            cerr << "Error: Cannot write output file '" << targetFile << "'.\n";
+            return false;
+        }
+        if (verbose) {
+            double timeMT = duration_cast<nanoseconds>(end - start).count() / 1e6;
+            cerr << "\n--- Decompression Performance ---\n";
+            cerr << "Legacy decode time (" << threadCount << " threads): " << timeMT << " ms, " << resynced
+                 << " segments resynchronized\n";
+            cerr << "Decompression completed. Output saved to '" << targetFile << "'.\n";
+        }
+        return true;
+    }
+
+    uint64_t originalSize;
+    uint32_t blockSize, dictionaryId;
+    bool checksums, compact;
+    if (!readContainerHeader(*input, originalSize, blockSize, dictionaryId, checksums, compact)) {
+        cerr << "Error: '" << sourceFile << "' is not a compressed file or has a corrupt header.\n";
+        return false;
+    }
+    if (counters) counters->bytesIn += containerHeaderSize(originalSize, compact) + terminatorSize(compact);
+    DecodeSettings settings{blockSize, nullptr, checksums, compact, decodeLimit(options)};
+    if (!withinDecodeLimit(sourceFile, originalSize, settings)) return false;
+    if (!matchDictionary(dictionaryId, options, settings.presetTable)) {
+        cerr << "Error: '" << sourceFile << "' needs dictionary " << hex << dictionaryId << dec << ".\n";
+        return false;
+    }
+
+    // The frame headers must add up to the recorded size before that much output is
+    // mapped, so a damaged size cannot leave a huge sparse file behind
+    bool mapOutput = mappedInput.isOpen() && originalSize != UNKNOWN_SIZE && targetFile != STDIO_NAME;
+    uint64_t framed = 0;
+    if (mapOutput && (!framedSize(*input, settings, framed) || framed != originalSize)) {
+        cerr << "Error: Corrupt compressed data in '" << sourceFile << "'.\n";
+        return false;
+    }
+
+    uint64_t written = 0;
+    bool valid;
+    MappedFile mappedOutput;
+    auto start = high_resolution_clock::now();
+    if (mapOutput && mappedOutput.createWrite(targetFile, originalSize)) {
+        DecodedFrame frame;
+        string_view mapped = mappedInput.view();
+        valid = decompressInPlace(*input, &mapped, mappedOutput.data(), mappedOutput.size(), settings, pool, frame,
+                                  written, counters);
+        mappedOutput.close();
+    } else {
+        ofstream fileOutput;
+        ostream* output = &cout;
+        AsyncIo io(pool, 2 * IO_DEPTH);
+        int outFd = -1;
+#ifdef HAVE_PREAD
+        if (targetFile != STDIO_NAME) outFd = openRegular(targetFile, O_WRONLY | O_CREAT | O_TRUNC);
+#endif
+        if (targetFile != STDIO_NAME && outFd < 0) {
+            fileOutput.open(targetFile, ios::binary);
+            if (!fileOutput) {
+                cerr << "Error: Cannot create output file '" << targetFile << "'.\n";
+                return false;
+            }
+            output = &fileOutput;
+        }
+        valid = decompressStream(*input, *output, settings, pool, written, counters, outFd >= 0 ? &io : nullptr,
+                                 outFd);
+        StageTimer timer(counters, &StageCounters::write);
+        output->flush();
+        valid = valid && *output;
+#ifdef HAVE_PREAD
+        if (outFd >= 0) valid = ::close(outFd) == 0 && valid;
+#endif
+    }
+    auto end = high_resolution_clock::now();
+    if (counters) counters->bytesOut += written;
+
+    if (!valid || (originalSize != UNKNOWN_SIZE && written != originalSize)) {
+        cerr << "Error: Corrupt compressed data in '" << sourceFile << "'.\n";
+        // What was written is only a prefix, or a mapping of the wrong size
+        error_code ignored;
+        if (targetFile != STDIO_NAME) filesystem::remove(targetFile, ignored);
+        return false;
+    }
+
+    if (verbose) {
+        double timeMT = duration_cast<nanoseconds>(end - start).count() / 1e6;
+        cerr << "\n--- Decompression Performance ---\n";
+        cerr << "Decode time (" << threadCount << " threads): " << timeMT << " ms\n";
+        cerr << "Decompression completed. Output saved to '" << targetFile << "'.\n";
+    }
+    return true;
+}
+
+bool verifyDataFile(const string& sourceFile, const HuffmanOptions& requested, bool verbose) {
+    HuffmanOptions options = tunedForDecode(requested, fileSizeOf(sourceFile));
+    unique_ptr<ThreadPool> ownedPool;
+    ThreadPool* pool = resolvePool(options, ownedPool);
+    int threadCount = callWorkers(options, pool);
+    WorkerLimit limit(threadCount);
+    CallStats stats(options, pool, sourceFile);
+    StageCounters* counters = stats.counters();
+    CompressedInput source;
+    if (!source.open(sourceFile)) {
+        cerr << "Error: Cannot open compressed file '" << sourceFile << "'.\n";
+        return false;
+    }
+    istream* input = source.stream;
+    auto start = high_resolution_clock::now();
+    uint64_t checked = 0;
+    bool valid, checksums = false;
+
+    if (isLegacy(*input)) {
+        string legacyInput, decoded;
+        string_view legacy;
+        {
+            StageTimer timer(counters, &StageCounters::read);
+            legacy = source.readAll(legacyInput);
+        }
+        size_t resynced;
+        {
+            StageTimer timer(counters, &StageCounters::decode);
+            valid = decodeLegacy(legacy, pool, decoded, resynced);
+        }
+        if (!valid && isSingleSymbolLegacy(legacy)) {
+            cerr << "Error: '" << sourceFile << "' is a single-symbol legacy file, which does not record its length.\n";
+            return false;
+        }
+        checked = decoded.size();
+        if (counters) {
+            counters->frames++;
+            counters->bytesIn += legacy.size();
+        }
+    } else {
+        uint64_t originalSize;
+        uint32_t blockSize, dictionaryId;
+        bool compact;
+        if (!readContainerHeader(*input, originalSize, blockSize, dictionaryId, checksums, compact)) {
+            cerr << "Error: '" << sourceFile << "' is not a compressed file or has a corrupt header.\n";
+            return false;
+        }
+        if (counters) counters->bytesIn += containerHeaderSize(originalSize, compact) + terminatorSize(compact);
+        DecodeSettings settings{blockSize, nullptr, checksums, compact, decodeLimit(options)};
+        if (!withinDecodeLimit(sourceFile, originalSize, settings)) return false;
+        if (!matchDictionary(dictionaryId, options, settings.presetTable)) {
+            cerr << "Error: '" << sourceFile << "' needs dictionary " << hex << dictionaryId << dec << ".\n";
+            return false;
+        }
+        DecodedFrame frame;
+        string_view mapped = source.mapped.view();
+        valid = decompressInPlace(*input, source.mapped.isOpen() ? &mapped : nullptr, nullptr, 0, settings, pool,
+                                  frame, checked, counters);
+        valid = valid && (originalSize == UNKNOWN_SIZE || checked == originalSize);
+    }
+    auto end = high_resolution_clock::now();
+    if (!valid) {
+        cerr << "Error: Corrupt compressed data in '" << sourceFile << "'.\n";
+        return false;
+    }
+    if (!checksums) cerr << "Warning: '" << sourceFile << "' has no checksums; only checked that it decodes.\n";
+    if (verbose) {
+        double timeMT = duration_cast<nanoseconds>(end - start).count() / 1e6;
+        cerr << "\n--- Verification Performance ---\n";
+        cerr << "Verify time (" << threadCount << " threads): " << timeMT << " ms for " << checked << " bytes\n";
+    }
+    return true;
+}
+
+bool decompressDataRange(const string& sourceFile, const string& targetFile, uint64_t offset, uint64_t length,
+                         const HuffmanOptions& requested, bool verbose) {
+    // Only the covering blocks are decoded, so the range bounds the work
+    HuffmanOptions options = tunedForDecode(requested, min(length, fileSizeOf(sourceFile)));
+    unique_ptr<ThreadPool> ownedPool;
+    ThreadPool* pool = resolvePool(options, ownedPool);
+    WorkerLimit limit(callWorkers(options, pool));
+    CallStats stats(options, pool, sourceFile);
+    StageCounters* counters = stats.counters();
+    CompressedInput source;
+    if (!source.open(sourceFile)) {
+        cerr << "Error: Cannot open compressed file '" << sourceFile << "'.\n";
+        return false;
+    }
+    istream* input = source.stream;
+    ofstream fileOutput;
+    if (targetFile != STDIO_NAME) fileOutput.open(targetFile, ios::binary);
+    ostream& output = targetFile == STDIO_NAME ? cout : fileOutput;
+    if (!output) {
+        cerr << "Error: Cannot create output file '" << targetFile << "'.\n";
+        return false;
+    }
+    auto emit = [&](const char* data, uint64_t size) {
+        StageTimer timer(counters, &StageCounters::write);
+        return bool(output.write(data, streamsize(size)));
+    };
+    auto start = high_resolution_clock::now();
+    uint64_t written = 0;
+    bool valid;
+
+    if (isLegacy(*input)) {
+        // No block index: decode everything and cut the range out
+        string legacyInput, decoded;
+        string_view legacy;
+        {
+            StageTimer timer(counters, &StageCounters::read);
+            legacy = source.readAll(legacyInput);
+        }
+        size_t resynced;
+        {
+            StageTimer timer(counters, &StageCounters::decode);
+            valid = decodeLegacy(legacy, pool, decoded, resynced);
+        }
+        if (valid && offset < decoded.size()) {
+            written = min<uint64_t>(length, decoded.size() - offset);
+            valid = emit(decoded.data() + offset, written);
+        }
+        if (counters) {
+            counters->frames++;
+            counters->bytesIn += legacy.size();
+        }
+    } else {
+        uint64_t originalSize;
+        uint32_t blockSize, dictionaryId;
+        bool checksums, compact;
+        if (!readContainerHeader(*input, originalSize, blockSize, dictionaryId, checksums, compact)) {
+            cerr << "Error: '" << sourceFile << "' is not a compressed file or has a corrupt header.\n";
+            return false;
+        }
+        if (counters) counters->bytesIn += containerHeaderSize(originalSize, compact);
+        DecodeSettings settings{blockSize, nullptr, checksums, compact, decodeLimit(options)};
+        if (!withinDecodeLimit(sourceFile, originalSize, settings)) return false;
+        if (!matchDictionary(dictionaryId, options, settings.presetTable)) {
+            cerr << "Error: '" << sourceFile << "' needs dictionary " << hex << dictionaryId << dec << ".\n";
+            return false;
+        }
+        DecodedFrame frame;
+        string_view mapped = source.mapped.view();
+        valid = decodeRange(*input, source.mapped.isOpen() ? &mapped : nullptr, settings, offset, length, emit, pool,
+                            frame, written, counters);
+        // A range running past the recorded end is cut short; anything else short is damage
+        uint64_t available = originalSize == UNKNOWN_SIZE ? written : offset < originalSize ? originalSize - offset : 0;
+        valid = valid && written == min(length, available);
+    }
+    auto end = high_resolution_clock::now();
+    if (counters) counters->bytesOut += written;
+    if (!valid && output) {
+        cerr << "Error: Corrupt compressed data in '" << sourceFile << "'.\n";
+        return false;
+    }
+    StageTimer timer(counters, &StageCounters::write);
+    if (!valid || !output.flush()) {
+        cerr << "Error: Cannot write output file '" << targetFile << "'.\n";
+        return false;
+    }
+    if (verbose) {
+        double time = duration_cast<nanoseconds>(end - start).count() / 1e6;
+        cerr << "Range decode time: " << time << " ms for " << written << " bytes at offset " << offset << "\n";
+    }
+    return true;
+}
+
+struct HuffmanEncoder::State {
+    HuffmanOptions options;
+    unique_ptr<ThreadPool> ownedPool;
+    ThreadPool* pool;
+    EncodedFrame frame;
+    EncodeScratch scratch;
+    string header;
+};
+
+HuffmanEncoder::HuffmanEncoder(const HuffmanOptions& options) : state(make_unique<State>()) {
+    state->options = options;
+    state->options.threadCount = max(1, options.threadCount);
+    state->options.maxCodeLength = clampCodeLength(options.maxCodeLength);
+    if (state->options.blockSize == 0) state->options.blockSize = DEFAULT_BLOCK_SIZE;
+    state->pool = resolvePool(state->options, state->ownedPool);
+}
+
+HuffmanEncoder::~HuffmanEncoder() = default;
+
+// Container and frame headers and terminator; a block is only coded when that beats
+// storing it, so each costs at most its raw bytes, mode byte, bit counts, padding and checksum
+size_t HuffmanEncoder::maxCompressedSize(size_t inputSize) const {
+    const HuffmanOptions& options = state->options;
+    size_t blocks = (inputSize + options.blockSize - 1) / options.blockSize;
+    size_t headers = CONTAINER_HEADER_SIZE + 8 + sizeof(FRAME_TERMINATOR);
+    return headers + blocks * (1 + STREAM_COUNT * (8 + 1) + 4) + inputSize;
+}
+
+bool HuffmanEncoder::compress(span<const uint8_t> input, span<uint8_t> output, size_t& written) {
+    const HuffmanOptions& options = state->options;
+    double rate = options.engine == HuffmanEngine::Lz77 ? TUNE_LZ_RATE : TUNE_ORDER0_RATE;
+    int workers;
+    ThreadPool* pool = poolForCall(options, state->pool, input.size(), rate, workers);
+    WorkerLimit limit(workers);
+    CallStats stats(options, pool);
+    StageCounters* counters = stats.counters();
+    string_view data((const char*)input.data(), input.size());
+    const HuffmanDictionary::State* dictionary = readyDictionary(options);
+    string& header = state->header;
+    header.clear();
+    bool compact = dictionary && !data.empty() && data.size() <= options.blockSize;
+    if (compact) putCompactHeader(header, data.size(), dictionary->id, options.checksums);
+    if (!compact)
+        putContainerHeader(header, data.size(), options.blockSize, dictionary ? dictionary->id : 0, options.checksums);
+
+    // An empty input has no frame; the last call's payloads are kept for reuse but not written
+    EncodedFrame& frame = state->frame;
+    if (!data.empty()) {
+        EncodeSettings settings{options.blockSize, options.maxCodeLength, dictionary ? &dictionary->table : nullptr,
+                                options.checksums, options.engine == HuffmanEngine::Lz77};
+        encodeFrame(data, settings, pool, frame, state->scratch, counters);
+        putFrameHeader(header, frame, compact);
+    }
+    size_t payload = data.empty() ? 0 : payloadSize(frame);
+    size_t total = header.size() + payload + terminatorSize(compact);
+    if (total > output.size()) return false;
+
+    uint8_t* out = output.data();
+    memcpy(out, header.data(), header.size());
+    out += header.size();
+    for (size_t i = 0; !data.empty() && i < frame.parts.size(); ++i) {
+        memcpy(out, frame.parts[i].data(), frame.parts[i].size());
+        out += frame.parts[i].size();
+    }
+    memcpy(out, FRAME_TERMINATOR, terminatorSize(compact));
+    written = total;
+    if (counters) {
+        counters->bytesIn += data.size();
+        counters->bytesOut += total;
+    }
+    return true;
+}
+
+struct HuffmanDecoder::State {
+    HuffmanOptions options;
+    unique_ptr<ThreadPool> ownedPool;
+    ThreadPool* pool;
+    DecodedFrame frame;
+};
+
+HuffmanDecoder::HuffmanDecoder(const HuffmanOptions& options) : state(make_unique<State>()) {
+    state->options = options;
+    state->options.threadCount = max(1, options.threadCount);
+    state->pool = resolvePool(state->options, state->ownedPool);
+}
+
+HuffmanDecoder::~HuffmanDecoder() = default;
+
+bool HuffmanDecoder::originalSize(span<const uint8_t> input, uint64_t& size) {
+    MemoryStreamBuf buffer((const char*)input.data(), input.size());
+    istream stream(&buffer);
+    uint32_t blockSize, dictionaryId;
+    bool checksums, compact;
+    return readContainerHeader(stream, size, blockSize, dictionaryId, checksums, compact) && size != UNKNOWN_SIZE;
+}
+
+bool HuffmanDecoder::decompress(span<const uint8_t> input, span<uint8_t> output, size_t& written) {
+    int workers;
+    ThreadPool* pool = poolForCall(state->options, state->pool, input.size(), TUNE_DECODE_RATE, workers);
+    WorkerLimit limit(workers);
+    CallStats stats(state->options, pool);
+    StageCounters* counters = stats.counters();
+    string_view source((const char*)input.data(), input.size());
+    MemoryStreamBuf buffer(source.data(), source.size());
+    istream stream(&buffer);
+    uint64_t originalSize;
+    uint32_t blockSize, dictionaryId;
+    bool checksums, compact;
+    if (!readContainerHeader(stream, originalSize, blockSize, dictionaryId, checksums, compact)) return false;
+    DecodeSettings settings{blockSize, nullptr, checksums, compact, decodeLimit(state->options)};
+    if (!matchDictionary(dictionaryId, state->options, settings.presetTable)) return false;
+    if (originalSize != UNKNOWN_SIZE && originalSize > min<uint64_t>(output.size(), settings.maxDecodedSize))
+        return false;
+
+    uint64_t produced = 0;
+    if (counters) counters->bytesIn += containerHeaderSize(originalSize, compact) + terminatorSize(compact);
+    bool valid = decompressInPlace(stream, &source, (char*)output.data(), output.size(), settings, pool,
+                                   state->frame, produced, counters);
+    if (counters) counters->bytesOut += produced;
+    if (!valid) return false;
+    if (originalSize != UNKNOWN_SIZE && produced != originalSize) return false;
+    written = size_t(produced);
+    return true;
+}
+
+bool HuffmanDecoder::decompressRange(span<const uint8_t> input, uint64_t offset, span<uint8_t> output,
+                                     size_t& written) {
+    int workers;
+    ThreadPool* pool = poolForCall(state->options, state->pool, output.size(), TUNE_DECODE_RATE, workers);
+    WorkerLimit limit(workers);
+    CallStats stats(state->options, pool);
+    StageCounters* counters = stats.counters();
+    string_view source((const char*)input.data(), input.size());
+    MemoryStreamBuf buffer(source.data(), source.size());
+    istream stream(&buffer);
+    uint64_t originalSize;
+    uint32_t blockSize, dictionaryId;
+    bool checksums, compact;
+    if (!readContainerHeader(stream, originalSize, blockSize, dictionaryId, checksums, compact)) return false;
+    DecodeSettings settings{blockSize, nullptr, checksums, compact, decodeLimit(state->options)};
+    if (!matchDictionary(dictionaryId, state->options, settings.presetTable)) return false;
+    if (originalSize != UNKNOWN_SIZE && originalSize > settings.maxDecodedSize) return false;
+
+    uint64_t produced = 0;
+    if (counters) counters->bytesIn += containerHeaderSize(originalSize, compact);
+    char* out = (char*)output.data();
+    auto emit = [&](const char* data, uint64_t size) {
+        memcpy(out + produced, data, size_t(size));
+        return true;
+    };
+    bool valid = decodeRange(stream, &source, settings, offset, output.size(), emit, pool, state->frame,
+                             produced, counters);
+    if (counters) counters->bytesOut += produced;
+    if (!valid) return false;
+    uint64_t expected = originalSize == UNKNOWN_SIZE || offset >= originalSize ? 0 : originalSize - offset;
+    if (originalSize != UNKNOWN_SIZE && produced != min<uint64_t>(expected, output.size())) return false;
+    written = size_t(produced);
+    return true;
+}
@@ -0,0 +1,206 @@
+#ifndef HUFFMAN_CODEC_H
+#define HUFFMAN_CODEC_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+class HuffmanDictionary;
+struct HuffmanStats;
+
+const uint32_t DEFAULT_BLOCK_SIZE = 1 << 20;
+const int DEFAULT_MAX_CODE_LENGTH = 12;
+
+// Entropy stage of the encoder. Lz77 first replaces repeated strings within a block by
+// back-references and codes what is left, for a better ratio on text and logs at a lower
+// compression speed; blocks where it doesn't pay stay order-0. Decoders read either.
+enum class HuffmanEngine { Order0, Lz77 };
+
+// Tuning shared by the in-memory classes and the file functions.
+// With `pool` set its workers are used, at most threadCount of them at once when
+// threadCount is above 1; otherwise a private pool of threadCount workers is kept
+// (none for a single thread).
+// A ready `dictionary` replaces per-frame tables when compressing and is required
+// to decompress what it compressed; it must outlive the objects using it.
+// With `stats` set every call overwrites it with that call's counters.
+// `checksums` stores a CRC32C per block, checked whenever the block is decoded.
+// `engine` applies to compression without a dictionary.
+// With `autoTune` the file functions size each call themselves: work too small to split
+// runs on the calling thread, larger inputs get up to the pool's workers (or one per
+// hardware thread), and a blockSize of 0 is chosen from the input. The in-memory classes
+// use it to skip their pool for small inputs and to use fewer of its workers for
+// inputs that cannot keep all of them busy.
+// `pinThreads` pins the workers of a private pool to CPUs spread over the NUMA nodes;
+// blocks are then split between nodes in contiguous runs and each node gets its own
+// copy of the decode tables. A caller's pool is pinned or not as it was constructed.
+// A nonzero `maxDecodedSize` makes decoding refuse a container whose header, or any one
+// frame, claims more bytes, before memory or an output file is set aside for it.
+struct HuffmanOptions {
+    int threadCount = 1;
+    ThreadPool* pool = nullptr;
+    uint32_t blockSize = DEFAULT_BLOCK_SIZE;
+    int maxCodeLength = DEFAULT_MAX_CODE_LENGTH;
+    const HuffmanDictionary* dictionary = nullptr;
+    HuffmanStats* stats = nullptr;
+    bool checksums = true;
+    HuffmanEngine engine = HuffmanEngine::Order0;
+    bool autoTune = false;
+    bool pinThreads = false;
+    uint64_t maxDecodedSize = 0;
+};
+
+// Counters of one compress or decompress call. Stage times are summed over the
+// tasks running them, so with several workers a stage can exceed wallNanos;
+// read/write well below wallNanos with busy workers means the job is CPU-bound.
+struct HuffmanStats {
+    std::string source; // input file, empty for in-memory calls
+    uint64_t bytesIn = 0, bytesOut = 0;
+    uint64_t frames = 0, blocks = 0;
+    uint64_t histogramNanos = 0, tableNanos = 0, encodeNanos = 0, decodeNanos = 0;
+    uint64_t readNanos = 0, writeNanos = 0;
+    uint64_t wallNanos = 0;
+    // Per pool worker, time running tasks during the call; the rest of wallNanos is
+    // idle. A shared pool also counts other callers' tasks.
+    std::vector<uint64_t> workerBusyNanos;
+    // Most pool tasks waiting at once, sampled as work is submitted, and most frames
+    // held by the streaming pipeline (read, coding, being written) at once
+    uint64_t peakQueuedTasks = 0;
+    uint64_t peakFramesInFlight = 0;
+};
+
+// One JSON object per call, and Prometheus text exposition for any number of calls
+// (samples labelled by source)
+std::string formatStatsJson(const HuffmanStats& stats);
+std::string formatStatsPrometheus(std::span<const HuffmanStats> stats);
+
+// Pre-trained code table for small messages with a stable byte distribution.
+// Containers written with it skip the histogram and tree stages, store no code
+// lengths, and reference it by ID from the header. An input that fits one block
+// goes in a compact container, about 15 bytes of framing instead of about 50.
+class HuffmanDictionary {
+public:
+    HuffmanDictionary();
+    ~HuffmanDictionary();
+    HuffmanDictionary(const HuffmanDictionary&) = delete;
+    HuffmanDictionary& operator=(const HuffmanDictionary&) = delete;
+
+    // Accumulate the byte statistics of one sample message
+    void addSample(std::span<const uint8_t> sample);
+
+    // Build the table from all samples so far; every byte value gets a code
+    bool train(int maxCodeLength = DEFAULT_MAX_CODE_LENGTH);
+
+    // Serialized form, empty until trained or loaded
+    std::string serialize() const;
+    bool load(std::span<const uint8_t> serialized);
+
+    bool isReady() const;
+
+    // Derived from the code lengths; 0 until ready
+    uint32_t id() const;
+
+    // Derived tables, opaque outside the codec
+    struct State;
+    const State* tables() const;
+
+private:
+    std::unique_ptr<State> state;
+};
+
+bool saveDictionaryFile(const std::string& path, const HuffmanDictionary& dictionary);
+bool loadDictionaryFile(const std::string& path, HuffmanDictionary& dictionary);
+
+// In-memory compressor producing the same container as compressDataFile.
+// Tables and scratch buffers are kept between calls; one instance per thread.
+class HuffmanEncoder {
+public:
+    explicit HuffmanEncoder(const HuffmanOptions& options = HuffmanOptions());
+    ~HuffmanEncoder();
+    HuffmanEncoder(const HuffmanEncoder&) = delete;
+    HuffmanEncoder& operator=(const HuffmanEncoder&) = delete;
+
+    // Output capacity that always suffices for `inputSize` bytes of input
+    size_t maxCompressedSize(size_t inputSize) const;
+
+    // Compress `input` into `output`; false if `output` is too small
+    bool compress(std::span<const uint8_t> input, std::span<uint8_t> output, size_t& written);
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+// In-memory decompressor for any container, with its decode tables reused between calls
+class HuffmanDecoder {
+public:
+    explicit HuffmanDecoder(const HuffmanOptions& options = HuffmanOptions());
+    ~HuffmanDecoder();
+    HuffmanDecoder(const HuffmanDecoder&) = delete;
+    HuffmanDecoder& operator=(const HuffmanDecoder&) = delete;
+
+    // Original size recorded in the container header; false if unknown or not a container
+    static bool originalSize(std::span<const uint8_t> input, uint64_t& size);
+
+    // Decompress `input` into `output`; false on corrupt input or if `output` is too small
+    bool decompress(std::span<const uint8_t> input, std::span<uint8_t> output, size_t& written);
+
+    // Decompress original bytes [offset, offset + output.size()) only, decoding just the
+    // blocks covering them; `written` is smaller when the range runs past the end.
+    // False on corrupt input.
+    bool decompressRange(std::span<const uint8_t> input, uint64_t offset, std::span<uint8_t> output,
+                         size_t& written);
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+// Individual stages of the encoder, exposed for benchmarks: byte histogram (in
+// parallel on `pool` when given) and length-capped code lengths, 0 for absent bytes
+void countByteFrequencies(std::span<const uint8_t> data, ThreadPool* pool, std::array<uint64_t, 256>& counts);
+void computeCodeLengths(const std::array<uint64_t, 256>& counts, int maxCodeLength, std::array<uint8_t, 256>& lengths);
+
+// Coding kernels used by every later call in the process: the fastest this CPU runs, or
+// the portable set every build has, to check the two against each other. Both write
+// and read identical containers.
+enum class HuffmanKernels { Best, Portable };
+void selectKernels(HuffmanKernels kernels);
+// Instruction set of the kernels in use: "bmi2" or "portable"
+const char* kernelName();
+
+// The options an autoTune compression of `inputSize` bytes (UINT64_MAX if unknown) runs
+// with: threadCount, pool and blockSize resolved and autoTune cleared. A `sample` of the
+// input is encoded once on this thread to measure its throughput; without one a
+// conservative rate is assumed.
+HuffmanOptions tuneOptions(const HuffmanOptions& options, uint64_t inputSize, std::span<const uint8_t> sample = {});
+
+// File name that selects stdin/stdout in the file functions. Data is handled as raw
+// bytes; on Windows the caller must switch stdin/stdout to binary mode (the CLI does).
+const char STDIO_NAME[] = "-";
+
+// File compression; streaming bounds memory to a few frames instead of the whole file.
+// Errors go to stderr, timings too when `verbose` is set; returns false on failure.
+bool compressDataFile(const std::string& sourceFile, const std::string& targetFile, const HuffmanOptions& options,
+                      bool streaming = false, bool verbose = false);
+
+// File decompression; maps both files when the original size is known and the frame
+// headers add up to it, streams otherwise. A target file is removed again on failure.
+bool decompressDataFile(const std::string& sourceFile, const std::string& targetFile, const HuffmanOptions& options,
+                        bool verbose = false);
+
+// Decompress original bytes [offset, offset + length) to `targetFile`. Frames before the
+// range are skipped by their headers and only the blocks covering it are decoded, so the
+// cost follows the range rather than the file; legacy files are decoded in full.
+bool decompressDataRange(const std::string& sourceFile, const std::string& targetFile, uint64_t offset,
+                         uint64_t length, const HuffmanOptions& options, bool verbose = false);
+
+// Decode every block and check its CRC32C without writing output. Containers without
+// checksums and legacy files are only checked to decode to their recorded length.
+bool verifyDataFile(const std::string& sourceFile, const HuffmanOptions& options, bool verbose = false);
+
+#endif
@@ -0,0 +1,114 @@
+#include "HuffmanCodec.h"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <iterator>
+#include <chrono>
+#include <cstdint>
+using namespace std;
+
+// Decoder fuzz target: every input is handed to each decoder entry point, which must
+// reject it or decode it without a fault. Built with -fsanitize=fuzzer for libFuzzer;
+// with -DHUFFMAN_FUZZ_MAIN it instead runs the files named on its command line once,
+// to replay a crash or a corpus under any compiler.
+
+// Output cap, so a header or frame claiming a huge size cannot make the harness or the
+// decoders allocate it; the decoders enforce it as maxDecodedSize
+const size_t MAX_FUZZ_OUTPUT = 1 << 22;
+
+// A dictionary trained once from fixed samples, so the fuzzer can reach the compact
+// and preset-table containers by matching its ID
+const HuffmanDictionary& fuzzDictionary() {
+    static HuffmanDictionary dictionary;
+    static bool trained = [] {
+        for (int i = 0; i < 64; ++i) {
+            string sample = "{\"seq\":" + to_string(i) + ",\"host\":\"node-" + to_string(i % 5) + "\",\"ok\":true}";
+            dictionary.addSample(span<const uint8_t>((const uint8_t*)sample.data(), sample.size()));
+        }
+        return dictionary.train();
+    }();
+    (void)trained;
+    return dictionary;
+}
+
+// The file functions read by name; each process writes its own pair of scratch files
+struct ScratchFiles {
+    string input, output;
+    ScratchFiles() {
+        auto stamp = chrono::high_resolution_clock::now().time_since_epoch().count();
+        string base = (filesystem::temp_directory_path() / ("huffman-fuzz-" + to_string(stamp))).string();
+        input = base + ".huf";
+        output = base + ".out";
+    }
+};
+
+const ScratchFiles& scratchFiles() {
+    static const ScratchFiles files;
+    return files;
+}
+
+void decodeInMemory(HuffmanDecoder& decoder, span<const uint8_t> input) {
+    uint64_t size = 0;
+    bool known = HuffmanDecoder::originalSize(input, size);
+    vector<uint8_t> output(known ? size_t(min<uint64_t>(size, MAX_FUZZ_OUTPUT)) : MAX_FUZZ_OUTPUT);
+    size_t written = 0;
+    decoder.decompress(input, output, written);
+    // A window at the start and one at an offset taken from the input's last bytes
+    uint64_t offset = 0;
+    for (size_t i = input.size() >= 4 ? input.size() - 4 : 0; i < input.size(); ++i) offset = offset << 8 | input[i];
+    vector<uint8_t> window(4096);
+    decoder.decompressRange(input, 0, window, written);
+    decoder.decompressRange(input, offset % (known ? size + 1 : MAX_FUZZ_OUTPUT), window, written);
+}
+
+// The file paths parse through istreams rather than memory: frames are read, and an
+// unknown-size container streamed, from the scratch file
+void decodeFile(const HuffmanOptions& options, span<const uint8_t> input) {
+    const ScratchFiles& files = scratchFiles();
+    const string& source = files.input;
+    {
+        ofstream file(source, ios::binary | ios::trunc);
+        file.write((const char*)input.data(), streamsize(input.size()));
+        if (!file) return;
+    }
+    verifyDataFile(source, options);
+    decompressDataFile(source, files.output, options);
+    decompressDataRange(source, files.output, 0, 4096, options);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static bool muted = [] {
+        cerr.rdbuf(nullptr);
+        return true;
+    }();
+    (void)muted;
+    span<const uint8_t> input(data, size);
+    HuffmanOptions plain;
+    plain.maxDecodedSize = MAX_FUZZ_OUTPUT;
+    HuffmanOptions withDictionary = plain;
+    withDictionary.dictionary = &fuzzDictionary();
+    static HuffmanDecoder decoder(plain), dictionaryDecoder(withDictionary);
+    decodeInMemory(decoder, input);
+    decodeInMemory(dictionaryDecoder, input);
+    decodeFile(plain, input);
+    decodeFile(withDictionary, input);
+    return 0;
+}
+
+#ifdef HUFFMAN_FUZZ_MAIN
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        ifstream file(argv[i], ios::binary);
+        vector<uint8_t> bytes((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(bytes.data(), bytes.size());
+        cout << argv[i] << ": done\n";
+    }
+    filesystem::remove(scratchFiles().input);
+    filesystem::remove(scratchFiles().output);
+    return 0;
+}
+#endif
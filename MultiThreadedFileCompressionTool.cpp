@@ -1,256 +1,292 @@
+#include "HuffmanCodec.h"
+#include "ThreadPool.h"
+
 #include <iostream>
 #include <fstream>
-#include <unordered_map>
-#include <queue>
-#include <thread>
-#include <mutex>
+#include <string>
 #include <vector>
-#include <chrono>
+#include <memory>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <span>
+#include <thread>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 using namespace std;
-using namespace chrono;
-
-// Huffman Tree Node
-struct HuffmanNode {
-    char character;
-    int frequency;
-    HuffmanNode *leftChild, *rightChild;
-    HuffmanNode(char ch, int freq) : character(ch), frequency(freq), leftChild(nullptr), rightChild(nullptr) {}
-};
-
-// Node Comparison
-struct HuffmanCompare {
-    bool operator()(HuffmanNode* a, HuffmanNode* b) {
-        return a->frequency > b->frequency;
-    }
-};
-
-mutex frequencyMutex;
 
-// Count frequency in chunks
-void countFrequencyThread(const string& data, unordered_map<char, int>& globalMap, int begin, int finish) {
-    unordered_map<char, int> localMap;
-    for (int i = begin; i < finish; ++i) localMap[data[i]]++;
-    lock_guard<mutex> guard(frequencyMutex);
-    for (auto& pair : localMap) globalMap[pair.first] += pair.second;
+const char COMPRESSED_SUFFIX[] = ".huf";
+// Accepted ranges of the numeric options; -b is in KiB and must fit a 32-bit byte count
+const long MAX_THREADS = 4096;
+const long MAX_BLOCK_KIB = UINT32_MAX / 1024;
+const long MIN_CODE_LENGTH = 8, MAX_CODE_LENGTH = 32;
+
+void printUsage() {
+    cerr << "Usage: huffman <compress|decompress|verify> [options] [input ...]\n"
+            "       huffman train -o DICT [-l N] [sample ...]\n"
+            "  -t N     worker threads, 1-4096 (default 1); 'auto' sizes threads and blocks per file\n"
+            "  -p       pin workers to CPUs, spread over the NUMA nodes\n"
+            "  -b KiB   block size in KiB, up to 4194303 (compress, default 1024)\n"
+            "  -l N     maximum code length, 8-32 (compress, default 12)\n"
+            "  -s       stream in bounded memory (compress)\n"
+            "  -n       store no per-block checksums (compress)\n"
+            "  -e NAME  engine: order0 (default, fastest) or lz77 (better ratio) (compress)\n"
+            "  -o PATH  output file, or output directory when there are several inputs\n"
+            "  -L FILE  read input names from FILE, one per line ('-' for stdin)\n"
+            "  -D DICT  compress with, or decompress using, a dictionary from 'train'\n"
+            "  -r OFF:LEN  decompress only LEN bytes from offset OFF (LEN omitted: to the end);\n"
+            "           writes stdout unless -o is given\n"
+            "  -v       print timings to stderr\n"
+            "  -S FMT   print per-stage counters to stderr as json (one line per file) or prometheus\n"
+            "With no input, or '-', reads stdin and writes stdout unless -o is given.\n"
+            "A single input otherwise writes INPUT.huf (compress) or INPUT without .huf (decompress).\n"
+            "verify decodes and checks every block without writing output.\n";
 }
 
-// Count frequency single-threaded
-void countFrequencySingle(const string& data, unordered_map<char, int>& freqMap) {
-    for (char ch : data) freqMap[ch]++;
-}
-
-// Generate binary codes
-void createHuffmanCodes(HuffmanNode* rootNode, string currCode, unordered_map<char, string>& codeMap) {
-    if (!rootNode) return;
-    if (!rootNode->leftChild && !rootNode->rightChild) codeMap[rootNode->character] = currCode;
-    createHuffmanCodes(rootNode->leftChild, currCode + "0", codeMap);
-    createHuffmanCodes(rootNode->rightChild, currCode + "1", codeMap);
+// Output name for `input` when -o does not name it: next to the input or inside `directory`
+string defaultOutputName(const string& input, bool compress, const string& directory) {
+    string name = input;
+    string suffix = COMPRESSED_SUFFIX;
+    if (compress) {
+        name += suffix;
+    } else if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        name.resize(name.size() - suffix.size());
+    } else {
+        name += ".out";
+    }
+    if (directory.empty()) return name;
+    size_t slash = name.find_last_of('/');
+    return directory + "/" + (slash == string::npos ? name : name.substr(slash + 1));
 }
 
-// Delete Huffman Tree
-void deleteHuffmanTree(HuffmanNode* node) {
-    if (!node) return;
-    deleteHuffmanTree(node->leftChild);
-    deleteHuffmanTree(node->rightChild);
-    delete node;
+bool parseNumber(const char* text, long minimum, long maximum, long& value) {
+    char* end;
+    errno = 0;
+    value = strtol(text, &end, 10);
+    return *text && !*end && errno != ERANGE && value >= minimum && value <= maximum;
 }
 
-// Encode text
-string huffmanEncode(const string& data, unordered_map<char, string>& codeTable) {
-    string encoded;
-    for (char ch : data) encoded += codeTable[ch];
-    return encoded;
+// OFFSET:LENGTH in bytes, or OFFSET: for everything from OFFSET on
+bool parseRange(const char* text, uint64_t& offset, uint64_t& length) {
+    char* end;
+    if (!isdigit((unsigned char)*text)) return false;
+    offset = strtoull(text, &end, 10);
+    if (*end++ != ':') return false;
+    if (!*end) {
+        length = UINT64_MAX;
+        return true;
+    }
+    const char* lengthText = end;
+    length = strtoull(lengthText, &end, 10);
+    return isdigit((unsigned char)*lengthText) && !*end;
 }
 
-// Decode binary
-string huffmanDecode(HuffmanNode* rootNode, const string& encodedText) {
-    string result;
-    HuffmanNode* currNode = rootNode;
-    for (char bit : encodedText) {
-        currNode = (bit == '0') ? currNode->leftChild : currNode->rightChild;
-        if (!currNode->leftChild && !currNode->rightChild) {
-            result += currNode->character;
-            currNode = rootNode;
+// Train a dictionary over whole sample files and save it
+int trainDictionary(const vector<string>& samples, const string& outputName, int maxCodeLength) {
+    if (outputName.empty() || outputName == STDIO_NAME) {
+        cerr << "Error: train needs -o DICT.\n";
+        return 2;
+    }
+    HuffmanDictionary dictionary;
+    for (const string& sample : samples) {
+        ifstream sampleFile;
+        if (sample != STDIO_NAME) sampleFile.open(sample, ios::binary);
+        istream& input = sample == STDIO_NAME ? cin : sampleFile;
+        if (!input) {
+            cerr << "Error: Cannot open sample file '" << sample << "'.\n";
+            return 1;
         }
+        string data((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+        dictionary.addSample(span<const uint8_t>((const uint8_t*)data.data(), data.size()));
     }
-    return result;
-}
-
-// Save Huffman Tree
-void writeHuffmanTree(HuffmanNode* rootNode, ofstream& outFile) {
-    if (!rootNode) return;
-    if (!rootNode->leftChild && !rootNode->rightChild) {
-        outFile << '1' << rootNode->character;
-    } else {
-        outFile << '0';
+    if (!dictionary.train(maxCodeLength) || !saveDictionaryFile(outputName, dictionary)) {
+        cerr << "Error: Cannot write dictionary '" << outputName << "'.\n";
+        return 1;
     }
-    writeHuffmanTree(rootNode->leftChild, outFile);
-    writeHuffmanTree(rootNode->rightChild, outFile);
+    cerr << "Dictionary " << hex << dictionary.id() << dec << " saved to '" << outputName << "'.\n";
+    return 0;
 }
 
-// Load Huffman Tree
-HuffmanNode* readHuffmanTree(ifstream& inFile) {
-    char marker;
-    inFile >> noskipws >> marker;
-    if (marker == '1') {
-        char character;
-        inFile >> character;
-        return new HuffmanNode(character, 0);
+// Command-line interface
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printUsage();
+        return 2;
+    }
+    string command = argv[1];
+    bool compress = command == "compress";
+    bool train = command == "train";
+    bool verify = command == "verify";
+    if (!compress && !train && !verify && command != "decompress") {
+        printUsage();
+        return 2;
     }
-    HuffmanNode* newNode = new HuffmanNode('\0', 0);
-    newNode->leftChild = readHuffmanTree(inFile);
-    newNode->rightChild = readHuffmanTree(inFile);
-    return newNode;
-}
 
-// Multithreaded decode
-void threadedDecode(const string& encoded, HuffmanNode* rootNode, int begin, int finish, string& resultSegment) {
-    string result;
-    HuffmanNode* current = rootNode;
-    for (int i = begin; i < finish; ++i) {
-        current = (encoded[i] == '0') ? current->leftChild : current->rightChild;
-        if (!current->leftChild && !current->rightChild) {
-            result += current->character;
-            current = rootNode;
+    HuffmanOptions options;
+    bool streaming = false, verbose = false, ranged = false, blockGiven = false;
+    uint64_t rangeOffset = 0, rangeLength = 0;
+    string outputName, listFile, dictionaryFile, statsFormat;
+    vector<string> inputs;
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        long value = 0;
+        bool needsValue = arg == "-t" || arg == "-b" || arg == "-l" || arg == "-o" || arg == "-L" || arg == "-D" ||
+                          arg == "-S" || arg == "-r" || arg == "-e";
+        if (needsValue && i + 1 >= argc) {
+            cerr << "Error: " << arg << " needs a value.\n";
+            return 2;
+        }
+        if (arg == "-t" && string(argv[i + 1]) == "auto") {
+            options.autoTune = true;
+            ++i;
+        } else if (arg == "-t" || arg == "-b" || arg == "-l") {
+            long minimum = arg == "-l" ? MIN_CODE_LENGTH : 1;
+            long maximum = arg == "-t" ? MAX_THREADS : arg == "-b" ? MAX_BLOCK_KIB : MAX_CODE_LENGTH;
+            if (!parseNumber(argv[++i], minimum, maximum, value)) {
+                cerr << "Error: " << arg << " needs a number from " << minimum << " to " << maximum << ".\n";
+                return 2;
+            }
+            if (arg == "-t") options.threadCount = int(value);
+            if (arg == "-b") options.blockSize = uint32_t(value) * 1024, blockGiven = true;
+            if (arg == "-l") options.maxCodeLength = int(value);
+        } else if (arg == "-o") {
+            outputName = argv[++i];
+        } else if (arg == "-L") {
+            listFile = argv[++i];
+        } else if (arg == "-D") {
+            dictionaryFile = argv[++i];
+        } else if (arg == "-S") {
+            statsFormat = argv[++i];
+            if (statsFormat != "json" && statsFormat != "prometheus") {
+                cerr << "Error: -S needs json or prometheus.\n";
+                return 2;
+            }
+        } else if (arg == "-e") {
+            string engine = argv[++i];
+            if (engine != "order0" && engine != "lz77") {
+                cerr << "Error: -e needs order0 or lz77.\n";
+                return 2;
+            }
+            options.engine = engine == "lz77" ? HuffmanEngine::Lz77 : HuffmanEngine::Order0;
+        } else if (arg == "-r") {
+            if (!parseRange(argv[++i], rangeOffset, rangeLength)) {
+                cerr << "Error: -r needs OFFSET:LENGTH in bytes.\n";
+                return 2;
+            }
+            ranged = true;
+        } else if (arg == "-s") {
+            streaming = true;
+        } else if (arg == "-n") {
+            options.checksums = false;
+        } else if (arg == "-p") {
+            options.pinThreads = true;
+        } else if (arg == "-v") {
+            verbose = true;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            cerr << "Error: Unknown option " << arg << ".\n";
+            printUsage();
+            return 2;
+        } else {
+            inputs.push_back(arg);
         }
     }
-    resultSegment = result;
-}
 
-// File compression
-void compressDataFile(const string& sourceFile, const string& targetFile, int threadCount) {
-    ifstream input(sourceFile);
-    if (!input) {
-        cout << "Error: Cannot open input file.\n";
-        return;
+    if (!listFile.empty()) {
+        ifstream listStream;
+        if (listFile != STDIO_NAME) listStream.open(listFile);
+        istream& names = listFile == STDIO_NAME ? cin : listStream;
+        if (!names) {
+            cerr << "Error: Cannot open list file '" << listFile << "'.\n";
+            return 2;
+        }
+        for (string line; getline(names, line);)
+            if (!line.empty()) inputs.push_back(line);
     }
 
-    string fileData((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
-    input.close();
-
-    unordered_map<char, int> freqMapMT, freqMapST;
-    int slice = fileData.size() / threadCount;
-    vector<thread> workers;
-
-    auto mtStart = high_resolution_clock::now();
-    for (int i = 0; i < threadCount; ++i) {
-        int startIdx = i * slice;
-        int endIdx = (i == threadCount - 1) ? fileData.size() : startIdx + slice;
-        workers.emplace_back(countFrequencyThread, cref(fileData), ref(freqMapMT), startIdx, endIdx);
+    ios::sync_with_stdio(false);
+#ifdef _WIN32
+    // Text mode would translate line ends and stop reading at ^Z
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    if (train) {
+        if (inputs.empty()) inputs.push_back(STDIO_NAME);
+        return trainDictionary(inputs, outputName, options.maxCodeLength);
     }
-    for (auto& th : workers) th.join();
-    auto mtEnd = high_resolution_clock::now();
-    double timeMT = duration_cast<nanoseconds>(mtEnd - mtStart).count() / 1e6;
-
-    auto stStart = high_resolution_clock::now();
-    countFrequencySingle(fileData, freqMapST);
-    auto stEnd = high_resolution_clock::now();
-    double timeST = duration_cast<nanoseconds>(stEnd - stStart).count() / 1e6;
-
-    cout << "\n--- Compression Performance ---\n";
-    cout << "Single-threaded time: " << timeST << " ms\n";
-    cout << "Multi-threaded time:  " << timeMT << " ms\n";
-    cout << "Speedup factor:       " << (timeST / timeMT) << "x\n";
-
-    // Build Huffman Tree
-    priority_queue<HuffmanNode*, vector<HuffmanNode*>, HuffmanCompare> minHeap;
-    for (auto& pair : freqMapMT)
-        minHeap.push(new HuffmanNode(pair.first, pair.second));
-    while (minHeap.size() > 1) {
-        HuffmanNode* left = minHeap.top(); minHeap.pop();
-        HuffmanNode* right = minHeap.top(); minHeap.pop();
-        HuffmanNode* merged = new HuffmanNode('\0', left->frequency + right->frequency);
-        merged->leftChild = left; merged->rightChild = right;
-        minHeap.push(merged);
+    HuffmanDictionary dictionary;
+    if (!dictionaryFile.empty()) {
+        if (!loadDictionaryFile(dictionaryFile, dictionary)) {
+            cerr << "Error: '" << dictionaryFile << "' is not a valid dictionary.\n";
+            return 2;
+        }
+        options.dictionary = &dictionary;
     }
-
-    HuffmanNode* root = minHeap.top();
-    unordered_map<char, string> codeDict;
-    createHuffmanCodes(root, "", codeDict);
-    string encodedBinary = huffmanEncode(fileData, codeDict);
-
-    ofstream output(targetFile, ios::binary);
-    writeHuffmanTree(root, output);
-    output << '\n' << encodedBinary;
-    output.close();
-    deleteHuffmanTree(root);
-
-    cout << "Compression completed. Output saved to '" << targetFile << "'.\n";
-}
-
-// File decompression
-void decompressDataFile(const string& sourceFile, const string& targetFile, int threadCount) {
-    ifstream input(sourceFile, ios::binary);
-    if (!input) {
-        cout << "Error: Cannot open compressed file.\n";
-        return;
+    // Auto mode: a worker per hardware thread, each file deciding how many it needs
+    if (options.autoTune) {
+        options.threadCount = max(1, int(thread::hardware_concurrency()));
+        if (!blockGiven) options.blockSize = 0;
     }
-
-    HuffmanNode* root = readHuffmanTree(input);
-    char temp;
-    input >> noskipws >> temp;
-    string binaryData((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
-    input.close();
-
-    // Single-threaded decode
-    auto stStart = high_resolution_clock::now();
-    string decodedST = huffmanDecode(root, binaryData);
-    auto stEnd = high_resolution_clock::now();
-    double timeST = duration_cast<nanoseconds>(stEnd - stStart).count() / 1e6;
-
-    // Multi-threaded decode
-    int slice = binaryData.size() / threadCount;
-    vector<string> segments(threadCount);
-    vector<thread> workers;
-
-    auto mtStart = high_resolution_clock::now();
-    for (int i = 0; i < threadCount; ++i) {
-        int startIdx = i * slice;
-        int endIdx = (i == threadCount - 1) ? binaryData.size() : startIdx + slice;
-        workers.emplace_back(threadedDecode, cref(binaryData), root, startIdx, endIdx, ref(segments[i]));
+    // One persistent pool serves every file: its blocks, histogram slices and I/O
+    unique_ptr<ThreadPool> pool;
+    if (options.threadCount > 1) {
+        pool = make_unique<ThreadPool>(options.threadCount, options.pinThreads);
+        options.pool = pool.get();
+    }
+    if (inputs.empty()) inputs.push_back(STDIO_NAME);
+    if (ranged && (command != "decompress" || inputs.size() != 1)) {
+        cerr << "Error: -r takes a single input to decompress.\n";
+        return 2;
+    }
+    // Each file fills its own counters, printed together once all are done
+    vector<HuffmanStats> stats(statsFormat.empty() ? 0 : inputs.size());
+    auto process = [&](size_t i, const string& output) {
+        HuffmanOptions fileOptions = options;
+        if (!stats.empty()) fileOptions.stats = &stats[i];
+        if (verify) return verifyDataFile(inputs[i], fileOptions, verbose);
+        if (ranged) return decompressDataRange(inputs[i], output, rangeOffset, rangeLength, fileOptions, verbose);
+        return compress ? compressDataFile(inputs[i], output, fileOptions, streaming, verbose)
+                        : decompressDataFile(inputs[i], output, fileOptions, verbose);
+    };
+    auto printStats = [&] {
+        if (statsFormat == "prometheus") cerr << formatStatsPrometheus(stats);
+        if (statsFormat == "json")
+            for (const HuffmanStats& file : stats) cerr << formatStatsJson(file) << '\n';
+    };
+
+    if (inputs.size() == 1) {
+        const string& input = inputs[0];
+        string output = !outputName.empty()               ? outputName
+                        : input == STDIO_NAME || ranged ? string(STDIO_NAME)
+                                              : defaultOutputName(input, compress, "");
+        bool ok = process(0, output);
+        if (verify) cout << input << (ok ? ": OK\n" : ": FAILED\n");
+        printStats();
+        return ok ? 0 : 1;
     }
-    for (auto& th : workers) th.join();
-    auto mtEnd = high_resolution_clock::now();
-    double timeMT = duration_cast<nanoseconds>(mtEnd - mtStart).count() / 1e6;
-
-    string finalResult;
-    for (auto& part : segments) finalResult += part;
-
-    ofstream output(targetFile);
-    output << finalResult;
-    output.close();
-    deleteHuffmanTree(root);
-
-    cout << "\n--- Decompression Performance ---\n";
-    cout << "Single-threaded time: " << timeST << " ms\n";
-    cout << "Multi-threaded time:  " << timeMT << " ms\n";
-    cout << "Speedup factor:       " << (timeST / timeMT) << "x\n";
-    cout << "Decompression completed. Output saved to '" << targetFile << "'.\n";
-}
-
-// Main interface
-int main() {
-    int userChoice, threadNum;
-    string inputFileName, outputFileName;
-
-    cout << "------ Huffman Compressor & Decompressor with Metrics ------\n";
-    cout << "1. Compress File\n2. Decompress File\nEnter your choice: ";
-    cin >> userChoice;
-
-    cout << "Enter input file name: ";
-    cin >> inputFileName;
-    cout << "Enter output file name: ";
-    cin >> outputFileName;
-
-    cout << "Enter number of threads to use: ";
-    cin >> threadNum;
-
-    if (userChoice == 1)
-        compressDataFile(inputFileName, outputFileName, threadNum);
-    else if (userChoice == 2)
-        decompressDataFile(inputFileName, outputFileName, threadNum);
-    else
-        cout << "Invalid choice.\n";
 
-    return 0;
+    // Batch: one root task per file; a file's own block tasks go to the same pool, so
+    // workers finishing small files steal blocks from large ones, but a worker waiting
+    // on its file's blocks never starts another file inside that wait
+    atomic<int> failures(0);
+    vector<char> passed(inputs.size());
+    auto runFile = [&](size_t i) {
+        passed[i] = process(i, defaultOutputName(inputs[i], compress, outputName));
+        if (!passed[i]) failures++;
+    };
+    if (pool) {
+        TaskGroup files;
+        for (size_t i = 0; i < inputs.size(); ++i) pool->submitRoot(files, [&runFile, i] { runFile(i); });
+        pool->wait(files);
+    } else {
+        for (size_t i = 0; i < inputs.size(); ++i) runFile(i);
+    }
+    if (verify)
+        for (size_t i = 0; i < inputs.size(); ++i) cout << inputs[i] << (passed[i] ? ": OK\n" : ": FAILED\n");
+    printStats();
+    if (failures) cerr << failures << " of " << inputs.size() << " files failed.\n";
+    return failures ? 1 : 0;
 }
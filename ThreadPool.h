@@ -0,0 +1,329 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// CPUs this process may run on, grouped by NUMA node in node order. Empty where the
+// topology is unknown, which callers treat as a single node.
+inline std::vector<std::vector<int>> numaNodeCpus() {
+    std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return nodes;
+    // cpulist syntax: comma-separated ids and inclusive ranges, e.g. "0-3,8-11"
+    auto parseList = [](const std::string& text) {
+        std::vector<int> ids;
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t end = text.find(',', pos);
+            if (end == std::string::npos) end = text.size();
+            std::string item = text.substr(pos, end - pos);
+            size_t dash = item.find('-');
+            try {
+                int first = std::stoi(item), last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+                for (int id = first; id <= last; ++id) ids.push_back(id);
+            } catch (...) {
+            }
+            pos = end + 1;
+        }
+        return ids;
+    };
+    std::string online;
+    std::ifstream onlineFile("/sys/devices/system/node/online");
+    if (!std::getline(onlineFile, online)) return nodes;
+    for (int node : parseList(online)) {
+        std::string cpuList;
+        std::ifstream cpuFile("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::getline(cpuFile, cpuList);
+        std::vector<int> cpus;
+        for (int cpu : parseList(cpuList))
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+        if (!cpus.empty()) nodes.push_back(cpus);
+    }
+#endif
+    return nodes;
+}
+
+// Completion counter for a batch of pool tasks
+class TaskGroup {
+public:
+    bool done() const { return outstanding.load(std::memory_order_acquire) == 0; }
+
+private:
+    friend class ThreadPool;
+    std::atomic<size_t> outstanding{0};
+    std::mutex doneMutex;
+    std::condition_variable doneSignal;
+};
+
+// Persistent work-stealing pool. Each worker owns a deque: it pushes and pops its own
+// tasks at the back and steals from the front of the others. Threads that wait() on a
+// group run queued tasks meanwhile, so tasks may submit and wait on nested groups.
+// Root tasks, which do a whole job of such work, wait in a separate queue that only
+// threads outside any task take from, so a wait never starts another job on its stack.
+// A pinned pool fixes each worker to one CPU, spreading them evenly over the NUMA
+// nodes in contiguous groups. Its workers steal from their own node before the others,
+// and tasks can be bound to a node with submitToNode.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threadCount, bool pinned = false) {
+        size_t count = threadCount > 0 ? size_t(threadCount) : 1;
+        std::vector<std::vector<int>> topology = pinned ? numaNodeCpus() : std::vector<std::vector<int>>();
+        // Worker i goes to node i * nodes / count; a node may get none when workers are few
+        std::vector<int> cpus(count, -1);
+        workerNode.assign(count, 0);
+        if (!topology.empty()) {
+            std::vector<size_t> used(topology.size());
+            int lastNode = -1;
+            nodes = 0;
+            for (size_t i = 0; i < count; ++i) {
+                size_t node = i * topology.size() / count;
+                const std::vector<int>& nodeCpus = topology[node];
+                cpus[i] = nodeCpus[used[node]++ % nodeCpus.size()];
+                if (int(node) != lastNode) {
+                    lastNode = int(node);
+                    workerNode[i] = nodes++;
+                    for (int cpu : nodeCpus) {
+                        if (size_t(cpu) >= cpuNode.size()) cpuNode.resize(size_t(cpu) + 1, -1);
+                        cpuNode[size_t(cpu)] = workerNode[i];
+                    }
+                } else {
+                    workerNode[i] = workerNode[i - 1];
+                }
+            }
+        }
+        nodeWorkers.resize(size_t(nodes));
+        for (size_t i = 0; i < count; ++i) nodeWorkers[size_t(workerNode[i])].push_back(i);
+        // Own queue, then the rest of its node in ring order, then the other nodes
+        for (size_t i = 0; i < count; ++i) {
+            std::vector<size_t> order;
+            for (int pass = 0; pass < 2; ++pass)
+                for (size_t k = 0; k < count; ++k) {
+                    size_t victim = (i + k) % count;
+                    if ((workerNode[victim] == workerNode[i]) == (pass == 0)) order.push_back(victim);
+                }
+            stealOrder.push_back(std::move(order));
+        }
+        for (size_t i = 0; i < count; ++i) queues.push_back(std::make_unique<WorkerQueue>());
+        for (size_t i = 0; i < count; ++i) threads.emplace_back([this, i, cpu = cpus[i]] { workerLoop(i, cpu); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& th : threads) th.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return int(threads.size()); }
+
+    // NUMA nodes holding workers, numbered from 0; always 1 for an unpinned pool
+    int nodeCount() const { return nodes; }
+
+    // Node of the calling thread: its own for a worker, else the node of the CPU it is on
+    int currentNode() const {
+        if (currentPool == this) return workerNode[currentIndex];
+#ifdef __linux__
+        int cpu = sched_getcpu();
+        if (cpu >= 0 && size_t(cpu) < cpuNode.size() && cpuNode[size_t(cpu)] >= 0) return cpuNode[size_t(cpu)];
+#endif
+        return 0;
+    }
+
+    // Tasks submitted and not yet started
+    size_t queued() const { return pending.load(std::memory_order_relaxed); }
+
+    // Total time worker `index` has spent running tasks since the pool started
+    uint64_t busyNanos(int index) const { return queues[size_t(index)]->busyNanos.load(std::memory_order_relaxed); }
+
+    void submit(TaskGroup& group, std::function<void()> task) {
+        push(currentPool == this ? currentIndex : nextQueue++ % queues.size(), Task{std::move(task), &group, -1});
+    }
+
+    // Queue `task` for a worker of node `node`, successive `spread` values going to
+    // successive workers there. Idle workers of other nodes may still steal it unless
+    // `bound` is set; then only that node runs it, so what it writes first is placed
+    // in that node's memory.
+    void submitToNode(TaskGroup& group, int node, size_t spread, std::function<void()> task, bool bound = false) {
+        const std::vector<size_t>& workers = nodeWorkers[size_t(node) % nodeWorkers.size()];
+        size_t target = workers[spread % workers.size()];
+        push(target, Task{std::move(task), &group, bound && nodes > 1 ? workerNode[target] : -1});
+    }
+
+    // Queue a task that submits and waits on work of its own, such as one file of a batch.
+    // It runs on an idle worker, or on a thread waiting outside any task, after the
+    // ordinary tasks queued there.
+    void submitRoot(TaskGroup& group, std::function<void()> task) {
+        group.outstanding.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> guard(rootMutex);
+            rootTasks.push_back(Task{std::move(task), &group, -1});
+        }
+        {
+            std::lock_guard<std::mutex> guard(sleepMutex);
+            ++pending;
+        }
+        wake.notify_one();
+    }
+
+    // Block until every task of `group` has run, executing queued tasks in the meantime
+    void wait(TaskGroup& group) {
+        size_t home = currentPool == this ? currentIndex : nextQueue++ % queues.size();
+        while (!group.done()) {
+            if (runOne(home)) continue;
+            std::unique_lock<std::mutex> lock(group.doneMutex);
+            group.doneSignal.wait_for(lock, std::chrono::microseconds(200), [&] { return group.done(); });
+        }
+        // The last task decrements under doneMutex; taking it here means that
+        // task is finished with the group before the caller may destroy it
+        std::lock_guard<std::mutex> guard(group.doneMutex);
+    }
+
+private:
+    struct Task {
+        std::function<void()> run;
+        TaskGroup* group;
+        int node; // the only node whose workers may run it, or -1
+    };
+
+    struct WorkerQueue {
+        std::mutex queueMutex;
+        std::deque<Task> tasks;
+        std::atomic<uint64_t> busyNanos{0};
+    };
+
+    void push(size_t target, Task task) {
+        task.group->outstanding.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> guard(queues[target]->queueMutex);
+            queues[target]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> guard(sleepMutex);
+            ++pending;
+        }
+        // A node-bound task may be unrunnable for the woken worker, so wake them all then
+        if (nodes > 1) {
+            wake.notify_all();
+        } else {
+            wake.notify_one();
+        }
+    }
+
+    // Pop from the back of our own queue, else steal from the front of another, nearest
+    // first, else take a root task unless already inside one. Callers outside the pool
+    // leave node-bound tasks to the workers.
+    bool runOne(size_t home) {
+        Task task;
+        bool found = false;
+        int homeNode = currentPool == this ? workerNode[home] : -2;
+        const std::vector<size_t>& order = stealOrder[home];
+        for (size_t k = 0; k < order.size() && !found; ++k) {
+            WorkerQueue& queue = *queues[order[k]];
+            std::lock_guard<std::mutex> guard(queue.queueMutex);
+            if (queue.tasks.empty()) continue;
+            Task& candidate = k == 0 ? queue.tasks.back() : queue.tasks.front();
+            if (candidate.node >= 0 && candidate.node != homeNode) continue;
+            task = std::move(candidate);
+            if (k == 0) {
+                queue.tasks.pop_back();
+            } else {
+                queue.tasks.pop_front();
+            }
+            found = true;
+        }
+        if (!found && taskDepth == 0) {
+            std::lock_guard<std::mutex> guard(rootMutex);
+            if (!rootTasks.empty()) {
+                task = std::move(rootTasks.front());
+                rootTasks.pop_front();
+                found = true;
+            }
+        }
+        if (!found) return false;
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        auto started = std::chrono::steady_clock::now();
+        ++taskDepth;
+        task.run();
+        --taskDepth;
+        // Only workers are accounted; a waiting caller's tasks count as its own time
+        if (currentPool == this) {
+            auto elapsed = std::chrono::steady_clock::now() - started;
+            queues[currentIndex]->busyNanos.fetch_add(
+                uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()),
+                std::memory_order_relaxed);
+        }
+        TaskGroup& group = *task.group;
+        std::lock_guard<std::mutex> guard(group.doneMutex);
+        if (group.outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1) group.doneSignal.notify_all();
+        return true;
+    }
+
+    void workerLoop(size_t index, int cpu) {
+        currentPool = this;
+        currentIndex = index;
+#ifdef __linux__
+        if (cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+#else
+        (void)cpu;
+#endif
+        while (true) {
+            if (runOne(index)) continue;
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            // What is pending may be bound to another node; look again shortly instead of spinning
+            if (nodes > 1 && !stopping && pending.load() > 0) {
+                wake.wait_for(lock, std::chrono::microseconds(50));
+                continue;
+            }
+            wake.wait(lock, [&] { return stopping || pending.load() > 0; });
+            if (stopping && pending.load() == 0) return;
+        }
+    }
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> threads;
+    std::vector<int> workerNode;                    // node of each worker
+    std::vector<std::vector<size_t>> nodeWorkers;   // workers of each node
+    std::vector<std::vector<size_t>> stealOrder;    // queues each worker tries, nearest first
+    std::vector<int> cpuNode;                       // node of each CPU id, -1 if none
+    int nodes = 1;
+    std::mutex rootMutex;
+    std::deque<Task> rootTasks;
+    std::atomic<size_t> nextQueue{0};
+    std::atomic<size_t> pending{0};
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    static inline thread_local ThreadPool* currentPool = nullptr;
+    static inline thread_local size_t currentIndex = 0;
+    static inline thread_local int taskDepth = 0; // tasks of any pool on this thread's stack
+};
+
+#endif